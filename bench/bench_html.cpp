@@ -0,0 +1,135 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measures extract_urls() on pathological inputs of growing size and checks
+// that the time per byte stays roughly constant.
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "html.hpp"
+
+using std::string;
+using std::cout;
+
+namespace
+{
+    // Repeats pattern until the string is size bytes long.
+    const string repeat(const string &pattern, const std::size_t size)
+    {
+        string out;
+        out.reserve(size + pattern.length());
+        while (out.length() < size)
+        {
+            out += pattern;
+        }
+        out.resize(size);
+
+        return out;
+    }
+
+    struct testcase
+    {
+        const char *name;
+        std::function<const string(std::size_t)> generate;
+    };
+
+    // Nanoseconds per byte, best of a few runs.
+    double measure(const string &html)
+    {
+        using namespace std::chrono;
+        double best = 0;
+
+        for (std::uint8_t run = 0; run < 5; ++run)
+        {
+            const auto start = steady_clock::now();
+            const std::vector<string> urls = extract_urls(html);
+            const auto end = steady_clock::now();
+            const double ns_per_byte =
+                static_cast<double>(duration_cast<nanoseconds>
+                                    (end - start).count()) / html.length();
+            if (run == 0 || ns_per_byte < best)
+            {
+                best = ns_per_byte;
+            }
+        }
+
+        return best;
+    }
+}
+
+int main()
+{
+    const std::vector<testcase> cases =
+    {
+        { "many links", [](std::size_t size)
+          {
+              return repeat("<p><a href=\"https://example.com/a?b=c&amp;d=e\" "
+                            "rel=\"nofollow\">x</a> ", size);
+          }},
+        { "many mentions", [](std::size_t size)
+          {
+              return repeat("<span class=\"h-card\"><a href=\"https://example."
+                            "com/@user\" class=\"u-url mention\">@user</a>"
+                            "</span> ", size);
+          }},
+        { "unterminated tag", [](std::size_t size)
+          {
+              return "<a href=\"" + repeat("a", size);
+          }},
+        { "unclosed attributes", [](std::size_t size)
+          {
+              return "<a " + repeat("href=x ", size);
+          }},
+        { "tag openers", [](std::size_t size)
+          {
+              return repeat("<a <a <", size);
+          }},
+        { "entities", [](std::size_t size)
+          {
+              return "<a href=\"" + repeat("&amp;&#x41;&bogus", size) + "\">";
+          }}
+    };
+    const std::vector<std::size_t> sizes = { 62500, 125000, 250000, 500000 };
+    constexpr double tolerance = 3.0;
+    bool linear = true;
+
+    cout << std::fixed << std::setprecision(2);
+    for (const testcase &test : cases)
+    {
+        cout << std::left << std::setw(22) << test.name;
+        double first = 0;
+        double last = 0;
+        for (const std::size_t size : sizes)
+        {
+            last = measure(test.generate(size));
+            if (first == 0)
+            {
+                first = last;
+            }
+            cout << std::right << std::setw(8) << last << " ns/B ";
+        }
+        const bool ok = (last <= first * tolerance);
+        cout << (ok ? " linear" : " NOT LINEAR") << '\n';
+        linear = linear && ok;
+    }
+
+    return linear ? 0 : 1;
+}
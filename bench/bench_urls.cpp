@@ -0,0 +1,281 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measures strip(), get_urls() and expand() without network access. URLs
+// that need expanding point to a redirect server in this process.
+//
+// Usage: bench_urls [iterations]
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <utility>
+#include <regex>
+#include <cstdint>
+#include <cstdlib>
+#include <syslog.h>
+#include <curl/curl.h>
+#include "expandurl-mastodon.hpp"
+#include "redirectserver.hpp"
+#include "corpus.hpp"
+
+using std::string;
+using std::cout;
+using std::chrono::microseconds;
+
+// Not read from or written to disk.
+ConfigJSON configfile("expandurl-mastodon-bench.json");
+
+namespace
+{
+    struct result
+    {
+        std::vector<microseconds> durations;
+        microseconds total;
+    };
+
+    // Runs `function` `iterations` times and measures every run.
+    const result measure(const std::uint32_t iterations,
+                         const std::function<void()> &function)
+    {
+        using namespace std::chrono;
+        result res;
+        res.durations.reserve(iterations);
+
+        const auto begin = steady_clock::now();
+        for (std::uint32_t i = 0; i < iterations; ++i)
+        {
+            const auto start = steady_clock::now();
+            function();
+            res.durations.push_back(
+                duration_cast<microseconds>(steady_clock::now() - start));
+        }
+        res.total = duration_cast<microseconds>(steady_clock::now() - begin);
+        std::sort(res.durations.begin(), res.durations.end());
+
+        return res;
+    }
+
+    void print(const string &name, const result &res,
+               const std::uint32_t items)
+    {
+        const std::size_t n = res.durations.size();
+        const auto percentile = [&res, n](const double p)
+        {
+            return res.durations[std::min(n - 1, static_cast<std::size_t>
+                                          (p * static_cast<double>(n)))]
+                .count();
+        };
+        const double per_second = static_cast<double>(n * items) * 1000000
+            / static_cast<double>(std::max<microseconds::rep>(
+                                      1, res.total.count()));
+
+        cout << std::left << std::setw(28) << name << std::right
+             << std::setw(10) << percentile(0.5) << " µs p50"
+             << std::setw(10) << percentile(0.99) << " µs p99"
+             << std::setw(12) << std::fixed << std::setprecision(0)
+             << per_second << " /s\n";
+    }
+
+    const string replace_all(string str, const string &from,
+                             const string &to)
+    {
+        for (size_t pos = str.find(from); pos != string::npos;
+             pos = str.find(from, pos + to.length()))
+        {
+            str.replace(pos, from.length(), to);
+        }
+
+        return str;
+    }
+
+    // Sets the options that keep the benchmark offline and reproducible.
+    void configure()
+    {
+        Json::Value &config = configfile.get_json();
+        config["cache"]["slots"] = 0;
+        config["shorteners"]["allow"].append("127.0.0.1");
+        config["expand"]["deadline"] = 5000;
+        config["expand"]["max_hops"] = 10;
+        init_replacements();
+        init_unwrap_rules();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const std::uint32_t iterations =
+        (argc > 1 ? static_cast<std::uint32_t>(std::atoi(argv[1])) : 200);
+    bool correct = true;
+
+    openlog("bench_urls", LOG_PERROR, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_ERR));
+    curl_global_init(CURL_GLOBAL_ALL);
+    configure();
+    RedirectServer server;
+
+    cout << "strip()\n";
+    const std::vector<string> dirty =
+    {
+        "https://www.example.org/news/article.html?utm_source=twitter&"
+        "utm_medium=social&utm_campaign=spring",
+        "https://amp.example.com/story/12345?service=amp&id=1",
+        "https://www.example.com/a/very/long/path/index.html?wt_mc=abc&id=5",
+        "https://www.example.com/clean/url/without/tracking",
+        "https://blog.example.net/2019/05/post-title/amp/?__twitter_"
+        "impression=true",
+        "https://www.example.org/search?q=tracking&page=2&wtmc=x&UTM_ID=5",
+        "https://example.com/?utm_source=rss&id=12&utm_medium=feed",
+        "https://www.example.com/watch?v=dQw4w9WgXcQ&feature=share"
+    };
+    const result filtered = measure(iterations * 10, [&dirty]
+    {
+        for (const string &url : dirty)
+        {
+            strip(url);
+        }
+    });
+    print("  8 URLs", filtered, 8);
+
+    // The same rules as regular expressions, one pass each, like strip() did
+    // before the URLFilter.
+    std::vector<std::pair<std::regex, string>> regexes;
+    const Json::Value &replace = configfile.get_json()["replace"];
+    for (auto it = replace.begin(); it != replace.end(); ++it)
+    {
+        using namespace std::regex_constants;
+        regexes.emplace_back(std::regex(it.name(), icase | optimize),
+                             (*it).asString());
+    }
+    const auto strip_regex = [&regexes](const string &url)
+    {
+        string newurl = url;
+        for (const auto &rule : regexes)
+        {
+            newurl = std::regex_replace(newurl, rule.first, rule.second);
+        }
+        if (newurl.find('&') != string::npos
+            && newurl.find('?') == string::npos)
+        {
+            newurl.replace(newurl.find('&'), 1, "?");
+        }
+        return newurl;
+    };
+    const result regex = measure(iterations * 10, [&dirty, &strip_regex]
+    {
+        for (const string &url : dirty)
+        {
+            strip_regex(url);
+        }
+    });
+    print("  8 URLs, regex", regex, 8);
+    cout << "  " << std::setprecision(1)
+         << static_cast<double>(regex.total.count())
+            / static_cast<double>(std::max<microseconds::rep>(
+                                      1, filtered.total.count()))
+         << " times faster than regex\n";
+    for (const string &url : dirty)
+    {
+        if (strip(url) != strip_regex(url))
+        {
+            std::cerr << "strip(): expected " << strip_regex(url) << ", got "
+                      << strip(url) << '\n';
+            correct = false;
+        }
+    }
+
+    cout << "get_urls() on the corpus\n";
+    std::vector<string> statuses;
+    for (const char *html : corpus)
+    {
+        statuses.push_back(replace_all(html, "%SERVER%", server.get_base()));
+    }
+    print("  all statuses", measure(iterations, [&statuses]
+    {
+        for (const string &html : statuses)
+        {
+            get_urls(html);
+        }
+    }), static_cast<std::uint32_t>(statuses.size()));
+    const std::vector<string> urls = get_urls(statuses[2]);
+    if (urls.size() != 2 || urls[0] != server.url(0, 0, 200) + "/a")
+    {
+        std::cerr << "get_urls() returned wrong URLs.\n";
+        correct = false;
+    }
+
+    cout << "expand()\n";
+    struct scenario
+    {
+        const char *name;
+        string url;
+        string expected;
+    };
+    const std::vector<scenario> scenarios =
+    {
+        { "  1 hop", server.url(1, 0, 200), server.url(0, 0, 200) },
+        { "  5 hops", server.url(5, 0, 200), server.url(0, 0, 200) },
+        { "  3 hops, 20 ms each", server.url(3, 20, 200),
+          server.url(0, 20, 200) },
+        { "  HEAD not allowed", server.url(1, 0, 405),
+          server.url(0, 0, 405) },
+        { "  server error", server.url(1, 0, 500), server.url(0, 0, 500) },
+        { "  connection dropped", server.url(1, 0, 0), server.url(0, 0, 0) },
+        { "  too many hops", server.url(15, 0, 200), "" }
+    };
+    for (const scenario &s : scenarios)
+    {
+        const std::uint32_t runs = std::max<std::uint32_t>(1, iterations / 4);
+        print(s.name, measure(runs, [&s] { expand(s.url); }), 1);
+        if (!s.expected.empty() && expand(s.url) != s.expected)
+        {
+            std::cerr << s.name << ": expected " << s.expected << ", got "
+                      << expand(s.url) << '\n';
+            correct = false;
+        }
+    }
+
+    cout << "get_urls() with 32 distinct short links\n";
+    for (const std::uint32_t delay : { 0, 10, 50 })
+    {
+        std::uint32_t round = 0;
+        const std::uint32_t runs = std::max<std::uint32_t>(1, iterations / 10);
+        print("  " + std::to_string(delay) + " ms per hop",
+              measure(runs, [&server, &round, delay]
+        {
+            // New URLs every round, so that nothing is shared.
+            string html;
+            for (std::uint8_t i = 0; i < 32; ++i)
+            {
+                html += "<a href=\"" + server.url(2, delay, 200) + '/'
+                    + std::to_string(round) + '/' + std::to_string(i)
+                    + "\">x</a> ";
+            }
+            ++round;
+            get_urls(html);
+        }), 32);
+    }
+
+    cout << server.get_requests() << " requests served.\n";
+    curl_global_cleanup();
+    closelog();
+
+    return correct ? 0 : 1;
+}
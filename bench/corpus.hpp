@@ -0,0 +1,81 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CORPUS_HPP
+#define CORPUS_HPP
+
+#include <array>
+
+// Status HTML as Mastodon and Pleroma send it. %SERVER% is replaced with the
+// address of the local redirect server, so that nothing leaves the machine.
+// All other links have long paths or queries and are only filtered.
+const std::array<const char*, 8> corpus =
+{{
+    // Link with the invisible/ellipsis spans Mastodon adds.
+    "<p>Great read about the early web: <a href=\"https://www.theguardian.com"
+    "/technology/2019/mar/12/tim-berners-lee-web-30-years\" rel=\"nofollow "
+    "noopener\" target=\"_blank\"><span class=\"invisible\">https://www."
+    "</span><span class=\"ellipsis\">theguardian.com/technology/201</span>"
+    "<span class=\"invisible\">9/mar/12/tim-berners-lee-web-30-years</span>"
+    "</a></p>",
+
+    // Reply with mentions, hashtags and a tracking link.
+    "<p><span class=\"h-card\"><a href=\"https://mastodon.social/@Gargron\" "
+    "class=\"u-url mention\">@<span>Gargron</span></a></span> <span "
+    "class=\"h-card\"><a href=\"https://example.social/@alice\" class=\"u-url "
+    "mention\">@<span>alice</span></a></span> see <a href=\"https://www."
+    "example.org/news/2019/04/some-article.html?utm_source=twitter&amp;"
+    "utm_medium=social&amp;utm_campaign=spring\" rel=\"nofollow noopener\">"
+    "https://www.example.org/news/2019/04/some-article.html</a> <a href=\""
+    "https://mastodon.social/tags/fediverse\" class=\"mention hashtag\" "
+    "rel=\"tag\">#<span>fediverse</span></a></p>",
+
+    // Shortened links that have to be expanded.
+    "<p>Two short links: <a href=\"%SERVER%/c/2/0/200/a\">short 1</a> and "
+    "<a href=\"%SERVER%/c/1/0/200/b\">short 2</a></p>",
+
+    // Google wrapper, unwrapped without a request.
+    "<p>From my mail: <a href=\"https://www.google.com/url?q=https%3A%2F%2F"
+    "www.example.com%2Fsome%2Flong%2Fpath%2Fto%2Fa%2Fpage&amp;sa=D&amp;"
+    "ust=1555000000000\" rel=\"nofollow noopener\">https://www.google.com/"
+    "url?q=…</a></p>",
+
+    // AMP link.
+    "<p><a href=\"https://www.google.com/amp/s/www.example.net/2019/04/10/"
+    "amp-story-with-a-long-slug/amp/\">amp</a> via <span class=\"h-card\">"
+    "<a href=\"https://pleroma.example/users/bob\" class=\"u-url mention\">"
+    "@<span>bob</span></a></span></p>",
+
+    // Pleroma style, attributes in another order, entities in the text.
+    "<p>&quot;Quote&quot; &amp; more: <a class=\"attachment\" href=\"https://"
+    "files.example.com/media/0123456789abcdef.jpg?name=photo.jpg\">photo</a>"
+    "<br/>and <a href='https://www.example.com/a/very/long/path/segment/"
+    "index.html?wt_mc=abc&amp;id=5'>single quotes</a></p>",
+
+    // No links at all.
+    "<p>Just text, no links. Lorem ipsum dolor sit amet, consetetur "
+    "sadipscing elitr, sed diam nonumy eirmod tempor invidunt ut labore et "
+    "dolore magna aliquyam erat, sed diam voluptua.</p>",
+
+    // Many links in one status.
+    "<p><a href=\"%SERVER%/c/1/0/200/c\">1</a> <a href=\"%SERVER%/c/1/0/200/d"
+    "\">2</a> <a href=\"%SERVER%/c/3/0/200/e\">3</a> <a href=\"https://www."
+    "example.com/some/long/enough/path/1\">4</a> <a href=\"https://www."
+    "example.com/some/long/enough/path/2?utm_source=x\">5</a> <a href=\""
+    "%SERVER%/c/1/0/200/c\">1 again</a></p>"
+}};
+
+#endif  // CORPUS_HPP
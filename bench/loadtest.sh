@@ -0,0 +1,83 @@
+#!/bin/sh
+#  This file is part of expandurl-mastodon.
+#  Copyright © 2019 tastytea <tastytea@tastytea.de>
+#
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, version 3.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Runs expandurl-mastodon against mockmastodon.py and reports the
+# mention-to-reply latency and the maximum sustainable rate of mentions.
+#
+# Usage: loadtest.sh path/to/expandurl-mastodon [mockmastodon.py options]
+#
+# The bot only talks HTTPS to its instance, so a throwaway CA is created and
+# mounted over the system CA bundle in a private mount namespace (needs
+# unshare from util-linux and unprivileged user namespaces). If that is not
+# possible, add $tmp/ca.pem to the system CA bundle by hand and set
+# LOADTEST_NO_UNSHARE=1.
+
+set -e
+
+if [ -z "$1" ]; then
+    echo "usage: $0 path/to/expandurl-mastodon [mockmastodon.py options]" >&2
+    exit 1
+fi
+bot="$(realpath "$1")"
+shift
+bench="$(dirname "$(realpath "$0")")"
+port="${LOADTEST_PORT:-8443}"
+redirect_port="${LOADTEST_REDIRECT_PORT:-8080}"
+
+tmp="$(mktemp -d)"
+trap 'kill ${bot_pid} ${mock_pid} 2>/dev/null; rm -rf "${tmp}"' EXIT INT TERM
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj "/CN=loadtest CA" \
+        -keyout "${tmp}/ca.key" -out "${tmp}/ca.pem" 2>/dev/null
+openssl req -newkey rsa:2048 -nodes -subj "/CN=127.0.0.1" \
+        -keyout "${tmp}/key.pem" -out "${tmp}/cert.csr" 2>/dev/null
+printf 'subjectAltName=IP:127.0.0.1\n' > "${tmp}/ext.cnf"
+openssl x509 -req -in "${tmp}/cert.csr" -CA "${tmp}/ca.pem" \
+        -CAkey "${tmp}/ca.key" -CAcreateserial -days 1 \
+        -extfile "${tmp}/ext.cnf" -out "${tmp}/cert.pem" 2>/dev/null
+
+mkdir "${tmp}/config"
+cat > "${tmp}/config/expandurl-mastodon.json" <<EOF
+{
+    "account": "bot@127.0.0.1:${port}",
+    "access_token": "loadtest",
+    "shorteners":
+    {
+        "allow": [ "127.0.0.1" ]
+    }
+}
+EOF
+
+python3 "${bench}/mockmastodon.py" --port "${port}" \
+        --redirect-port "${redirect_port}" \
+        --cert "${tmp}/cert.pem" --key "${tmp}/key.pem" "$@" &
+mock_pid=$!
+sleep 1
+
+if [ -n "${LOADTEST_NO_UNSHARE}" ]; then
+    XDG_CONFIG_HOME="${tmp}/config" "${bot}" &
+else
+    # Find the bundle libcurl uses and replace it with our CA.
+    bundle="$(curl-config --ca 2>/dev/null || true)"
+    if [ -z "${bundle}" ]; then
+        bundle=/etc/ssl/certs/ca-certificates.crt
+    fi
+    XDG_CONFIG_HOME="${tmp}/config" unshare -rm sh -c \
+        "mount --bind '${tmp}/ca.pem' '${bundle}' && exec '${bot}'" &
+fi
+bot_pid=$!
+
+wait "${mock_pid}"
@@ -0,0 +1,337 @@
+#!/usr/bin/env python3
+#  This file is part of expandurl-mastodon.
+#  Copyright © 2019 tastytea <tastytea@tastytea.de>
+#
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, version 3.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+"""Local stand-in for a Mastodon instance, with a load generator.
+
+Serves the endpoints expandurl-mastodon uses over HTTPS, plus redirect chains
+over plain HTTP for the links in the replied-to posts. Mentions are pushed
+over the streaming API at increasing rates; the time until the reply arrives
+is measured for every mention.
+
+Started by loadtest.sh, which also creates the certificate and runs the bot.
+"""
+
+import argparse
+import email.parser
+import json
+import queue
+import ssl
+import sys
+import threading
+import time
+import urllib.parse
+from datetime import datetime, timedelta, timezone
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+BOT = "bot"
+USER = "alice@remote.example"
+
+
+class State:
+    """Everything the handlers share."""
+
+    def __init__(self, redirect_base):
+        self.lock = threading.Lock()
+        self.redirect_base = redirect_base
+        self.next_id = 100000
+        self.statuses = {}
+        self.streams = []
+        self.sent = {}          # mention status ID -> time it was pushed
+        self.replies = {}       # mention status ID -> time the reply arrived
+        self.requests = {}      # endpoint -> count
+
+    def new_id(self):
+        with self.lock:
+            self.next_id += 1
+            return str(self.next_id)
+
+    def count(self, endpoint):
+        with self.lock:
+            self.requests[endpoint] = self.requests.get(endpoint, 0) + 1
+
+
+def account(acct):
+    return {"id": "1", "username": acct.split("@")[0], "acct": acct,
+            "display_name": acct, "url": "https://remote.example/@alice"}
+
+
+def status(state, content, in_reply_to_id=None, acct=USER):
+    status_id = state.new_id()
+    data = {
+        "id": status_id,
+        "uri": "https://remote.example/statuses/" + status_id,
+        "url": "https://remote.example/@alice/" + status_id,
+        "account": account(acct),
+        "in_reply_to_id": in_reply_to_id,
+        "content": content,
+        "created_at": datetime.now(timezone.utc).isoformat(),
+        "visibility": "public",
+        "sensitive": False,
+        "spoiler_text": "",
+        "mentions": [],
+        "tags": [],
+        "emojis": [],
+        "media_attachments": [],
+    }
+    with state.lock:
+        state.statuses[status_id] = data
+    return data
+
+
+def parent_content(state, number, links):
+    html = "<p>Links:"
+    for link in range(links):
+        url = "%s/c/2/5/200/%d/%d" % (state.redirect_base, number, link)
+        html += ' <a href="%s" rel="nofollow noopener">%s</a>' % (url, url)
+    return html + "</p>"
+
+
+def push_mention(state, number, links):
+    parent = status(state, parent_content(state, number, links))
+    mention = status(state, '<p><span class="h-card"><a href="https://'
+                     'mock.example/@bot" class="u-url mention">@<span>bot'
+                     '</span></a></span> expand</p>', parent["id"])
+    notification = {
+        "id": state.new_id(),
+        "type": "mention",
+        "created_at": mention["created_at"],
+        "account": mention["account"],
+        "status": mention,
+    }
+    event = "event: notification\ndata: %s\n\n" % json.dumps(notification)
+    with state.lock:
+        state.sent[mention["id"]] = time.monotonic()
+        streams = list(state.streams)
+    for stream in streams:
+        stream.put(event.encode())
+
+
+def parse_form(handler, body):
+    ctype = handler.headers.get("Content-Type", "")
+    if ctype.startswith("application/json"):
+        return json.loads(body or b"{}")
+    if ctype.startswith("multipart/form-data"):
+        message = email.parser.BytesParser().parsebytes(
+            b"Content-Type: " + ctype.encode() + b"\r\n\r\n" + body)
+        return {part.get_param("name", header="content-disposition"):
+                part.get_payload(decode=True).decode()
+                for part in message.get_payload()}
+    return {key: values[0] for key, values
+            in urllib.parse.parse_qs(body.decode()).items()}
+
+
+class MastodonHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    state = None
+
+    def log_message(self, *args):
+        pass
+
+    def send_json(self, data, code=200):
+        body = json.dumps(data).encode()
+        reset = datetime.now(timezone.utc) + timedelta(minutes=5)
+        self.send_response(code)
+        self.send_header("Content-Type", "application/json; charset=utf-8")
+        self.send_header("Content-Length", str(len(body)))
+        self.send_header("X-RateLimit-Limit", "1000000")
+        self.send_header("X-RateLimit-Remaining", "999999")
+        self.send_header("X-RateLimit-Reset",
+                         reset.strftime("%Y-%m-%dT%H:%M:%S.000Z"))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_GET(self):
+        path = urllib.parse.urlparse(self.path).path
+        if path == "/api/v1/streaming/user":
+            self.state.count("streaming")
+            return self.stream()
+        if path == "/api/v1/notifications":
+            self.state.count("notifications")
+            return self.send_json([])
+        if path in ("/api/v1/search", "/api/v2/search"):
+            self.state.count("search")
+            return self.send_json({"accounts": [], "statuses": [],
+                                   "hashtags": []})
+        if path.startswith("/api/v1/statuses/"):
+            self.state.count("statuses/:id")
+            status_id = path.rsplit("/", 1)[1]
+            with self.state.lock:
+                data = self.state.statuses.get(status_id)
+            if data is None:
+                return self.send_json({"error": "Record not found"}, 404)
+            return self.send_json(data)
+        self.send_json({"error": "Not implemented"}, 404)
+
+    def do_POST(self):
+        path = urllib.parse.urlparse(self.path).path
+        body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        if path != "/api/v1/statuses":
+            return self.send_json({"error": "Not implemented"}, 404)
+        self.state.count("post status")
+        form = parse_form(self, body)
+        reply_to = form.get("in_reply_to_id", "")
+        with self.state.lock:
+            if reply_to in self.state.sent:
+                self.state.replies.setdefault(reply_to, time.monotonic())
+        self.send_json(status(self.state, form.get("status", ""), reply_to,
+                              BOT))
+
+    def stream(self):
+        events = queue.Queue()
+        with self.state.lock:
+            self.state.streams.append(events)
+        self.send_response(200)
+        self.send_header("Content-Type", "text/event-stream")
+        self.send_header("Transfer-Encoding", "chunked")
+        self.end_headers()
+        try:
+            while True:
+                try:
+                    data = events.get(timeout=10)
+                except queue.Empty:
+                    data = b":thump\n"
+                self.wfile.write(b"%x\r\n%s\r\n" % (len(data), data))
+                self.wfile.flush()
+        except OSError:
+            pass
+        finally:
+            with self.state.lock:
+                self.state.streams.remove(events)
+
+
+class RedirectHandler(BaseHTTPRequestHandler):
+    """/c/<hops>/<delay>/<code>, like bench/redirectserver.cpp."""
+
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, *args):
+        pass
+
+    def do_HEAD(self):
+        parts = self.path.split("/")
+        try:
+            hops, delay, code = int(parts[2]), int(parts[3]), int(parts[4])
+        except (IndexError, ValueError):
+            hops, delay, code = 0, 0, 404
+        time.sleep(delay / 1000)
+        if hops > 0:
+            parts[2] = str(hops - 1)
+            self.send_response(301)
+            self.send_header("Location", "/".join(parts))
+        else:
+            self.send_response(code)
+        self.send_header("Content-Length", "0")
+        self.end_headers()
+
+    do_GET = do_HEAD
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p * len(values)))]
+
+
+def run_load(state, rates, duration, links, max_p99, settle):
+    print("%8s %8s %8s %10s %10s" % ("rate/s", "sent", "replied", "p50 ms",
+                                     "p99 ms"))
+    sustainable = 0
+    number = 0
+    for rate in rates:
+        with state.lock:
+            state.sent.clear()
+            state.replies.clear()
+        start = time.monotonic()
+        for i in range(int(rate * duration)):
+            # Spread the mentions evenly over the period.
+            delay = start + i / rate - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+            push_mention(state, number, links)
+            number += 1
+        deadline = time.monotonic() + settle
+        while time.monotonic() < deadline:
+            with state.lock:
+                if len(state.replies) == len(state.sent):
+                    break
+            time.sleep(0.1)
+
+        with state.lock:
+            latencies = [(state.replies[i] - state.sent[i]) * 1000
+                         for i in state.replies]
+            sent = len(state.sent)
+        if not latencies:
+            print("%8d %8d %8d" % (rate, sent, 0))
+            break
+        p50, p99 = percentile(latencies, 0.5), percentile(latencies, 0.99)
+        print("%8d %8d %8d %10.0f %10.0f" % (rate, sent, len(latencies), p50,
+                                              p99))
+        sys.stdout.flush()
+        if len(latencies) < sent or p99 > max_p99:
+            break
+        sustainable = rate
+    print("Maximum sustainable rate: %d mentions/s (p99 <= %d ms)"
+          % (sustainable, max_p99))
+    print("Requests: " + ", ".join("%s: %d" % item
+                                    for item in sorted(state.requests.items())))
+
+
+def serve(server):
+    thread = threading.Thread(target=server.serve_forever, daemon=True)
+    thread.start()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--port", type=int, default=8443)
+    parser.add_argument("--redirect-port", type=int, default=8080)
+    parser.add_argument("--cert", required=True)
+    parser.add_argument("--key", required=True)
+    parser.add_argument("--rates", default="1,2,5,10,20,50,100",
+                        help="mentions per second, comma separated")
+    parser.add_argument("--duration", type=float, default=10,
+                        help="seconds per rate")
+    parser.add_argument("--links", type=int, default=3,
+                        help="links in every replied-to post")
+    parser.add_argument("--max-p99", type=int, default=5000,
+                        help="highest acceptable p99 latency in ms")
+    parser.add_argument("--settle", type=float, default=30,
+                        help="seconds to wait for outstanding replies")
+    args = parser.parse_args()
+
+    state = State("http://127.0.0.1:%d" % args.redirect_port)
+    MastodonHandler.state = state
+    api = ThreadingHTTPServer(("127.0.0.1", args.port), MastodonHandler)
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    context.load_cert_chain(args.cert, args.key)
+    api.socket = context.wrap_socket(api.socket, server_side=True)
+    redirects = ThreadingHTTPServer(("127.0.0.1", args.redirect_port),
+                                    RedirectHandler)
+    serve(api)
+    serve(redirects)
+
+    print("Waiting for the bot to connect...")
+    while True:
+        with state.lock:
+            if state.streams:
+                break
+        time.sleep(0.1)
+
+    run_load(state, [int(rate) for rate in args.rates.split(",")],
+             args.duration, args.links, args.max_p99, args.settle)
+
+
+if __name__ == "__main__":
+    main()
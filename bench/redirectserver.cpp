@@ -0,0 +1,194 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "redirectserver.hpp"
+
+using std::string;
+
+RedirectServer::RedirectServer()
+: _fd(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0))
+, _port(0)
+, _running(true)
+, _requests(0)
+{
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    const int one = 1;
+
+    setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+        || listen(_fd, 128) != 0
+        || getsockname(_fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0)
+    {
+        close(_fd);
+        throw std::runtime_error("Could not start redirect server.");
+    }
+    _port = ntohs(addr.sin_port);
+    _thread = std::thread(&RedirectServer::accept_loop, this);
+}
+
+RedirectServer::~RedirectServer()
+{
+    _running = false;
+    shutdown(_fd, SHUT_RDWR);
+    _thread.join();
+    close(_fd);
+
+    std::lock_guard<std::mutex> lock(_connections_mutex);
+    for (std::thread &connection : _connections)
+    {
+        connection.join();
+    }
+}
+
+const string RedirectServer::url(const std::uint16_t hops,
+                                 const std::uint32_t delay,
+                                 const std::uint16_t code) const
+{
+    return get_base() + "/c/" + std::to_string(hops) + '/'
+        + std::to_string(delay) + '/' + std::to_string(code);
+}
+
+const string RedirectServer::get_base() const
+{
+    return "http://127.0.0.1:" + std::to_string(_port);
+}
+
+std::uint64_t RedirectServer::get_requests() const
+{
+    return _requests;
+}
+
+void RedirectServer::accept_loop()
+{
+    while (_running)
+    {
+        pollfd pfd = { _fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) <= 0)
+        {
+            continue;
+        }
+        const int fd = accept4(_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(_connections_mutex);
+        _connections.emplace_back(&RedirectServer::serve, this, fd);
+    }
+}
+
+void RedirectServer::serve(const int fd)
+{
+    string buffer;
+    char data[4096];
+
+    while (_running)
+    {
+        const size_t end = buffer.find("\r\n\r\n");
+        if (end == string::npos)
+        {
+            pollfd pfd = { fd, POLLIN, 0 };
+            if (poll(&pfd, 1, 100) <= 0)
+            {
+                continue;
+            }
+            const ssize_t n = recv(fd, data, sizeof(data), 0);
+            if (n <= 0)
+            {
+                break;
+            }
+            buffer.append(data, static_cast<size_t>(n));
+            continue;
+        }
+
+        // GET /c/3/0/200 HTTP/1.1
+        const string request = buffer.substr(0, end);
+        buffer.erase(0, end + 4);
+        const size_t space1 = request.find(' ');
+        const size_t space2 = request.find(' ', space1 + 1);
+        if (space1 == string::npos || space2 == string::npos)
+        {
+            break;
+        }
+        ++_requests;
+        if (!answer(fd, request.substr(0, space1),
+                    request.substr(space1 + 1, space2 - space1 - 1)))
+        {
+            break;
+        }
+    }
+
+    close(fd);
+}
+
+bool RedirectServer::answer(const int fd, const string &method,
+                            const string &path)
+{
+    unsigned int hops = 0;
+    unsigned int delay = 0;
+    unsigned int code = 404;
+    int length = 0;
+    if (std::sscanf(path.c_str(), "/c/%u/%u/%u%n",
+                    &hops, &delay, &code, &length) != 3)
+    {
+        hops = 0;
+        code = 404;
+    }
+    // Keep the suffix, so that every chain ends at its own URL.
+    const string suffix = path.substr(static_cast<size_t>(length));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+
+    string response;
+    if (hops > 0)
+    {
+        response = "HTTP/1.1 301 Moved Permanently\r\nLocation: "
+            + url(static_cast<std::uint16_t>(hops - 1), delay,
+                  static_cast<std::uint16_t>(code))
+            + suffix + "\r\n";
+    }
+    else if (code == 0)
+    {
+        return false;
+    }
+    else if (code == 405 && method == "HEAD")
+    {
+        response = "HTTP/1.1 405 Method Not Allowed\r\n";
+    }
+    else
+    {
+        const unsigned int status = (code == 405 ? 200 : code);
+        response = "HTTP/1.1 " + std::to_string(status) + " Whatever\r\n";
+    }
+    response += "Content-Length: 0\r\nConnection: keep-alive\r\n\r\n";
+
+    return send(fd, response.c_str(), response.length(), MSG_NOSIGNAL)
+        == static_cast<ssize_t>(response.length());
+}
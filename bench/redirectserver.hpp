@@ -0,0 +1,84 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REDIRECTSERVER_HPP
+#define REDIRECTSERVER_HPP
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+using std::string;
+
+/*!
+ *  @brief  HTTP server on localhost that serves redirect chains
+ *
+ *          `/c/<hops>/<delay>/<code>` redirects to `/c/<hops - 1>/…` until
+ *          hops is 0, then answers with `code`. Every answer is delayed by
+ *          `delay` milliseconds. Special codes:
+ *          - 0: The connection is closed without an answer.
+ *          - 405: HEAD is answered with 405, GET with 200.
+ *
+ *          Anything after `<code>` is kept in the redirects, to make URLs
+ *          unique. Runs one thread per connection and supports keep-alive.
+ *
+ *          Example:
+ *  @code
+ *          RedirectServer server;
+ *          expand(server.url(3, 0, 200));  // -> server.url(0, 0, 200)
+ *  @endcode
+ */
+class RedirectServer
+{
+public:
+    RedirectServer();
+    ~RedirectServer();
+
+    /*!
+     *  @brief  Returns the URL of a redirect chain
+     */
+    const string url(const std::uint16_t hops, const std::uint32_t delay,
+                     const std::uint16_t code) const;
+
+    /*!
+     *  @brief  Returns `http://127.0.0.1:<port>`
+     */
+    const string get_base() const;
+
+    /*!
+     *  @brief  Returns the number of requests served
+     */
+    std::uint64_t get_requests() const;
+
+private:
+    int _fd;
+    std::uint16_t _port;
+    std::atomic<bool> _running;
+    std::atomic<std::uint64_t> _requests;
+    std::thread _thread;
+    std::vector<std::thread> _connections;
+    std::mutex _connections_mutex;
+
+    void accept_loop();
+    void serve(const int fd);
+    // Returns false if the connection should be closed.
+    bool answer(const int fd, const string &method, const string &path);
+};
+
+#endif  // REDIRECTSERVER_HPP
@@ -0,0 +1,261 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "checkpoint.hpp"
+
+using std::string;
+
+namespace
+{
+    // IDs are numbers of arbitrary length.
+    bool newer(const string &id, const string &than)
+    {
+        return id.length() > than.length()
+            || (id.length() == than.length() && id > than);
+    }
+
+    bool valid(const string &id)
+    {
+        return !id.empty()
+            && std::all_of(id.begin(), id.end(),
+                           [](const char c) { return c >= '0' && c <= '9'; });
+    }
+}
+
+Checkpoint::Checkpoint(const string &path,
+                       const std::chrono::milliseconds &interval,
+                       const std::uint32_t compact_after,
+                       const compactor &compact)
+: _path(path)
+, _interval(interval)
+, _compact_after(compact_after > 0 ? compact_after : 1)
+, _compact(compact)
+, _fd(-1)
+, _entries(0)
+, _running(false)
+{}
+
+Checkpoint::~Checkpoint()
+{
+    stop();
+    if (_fd != -1)
+    {
+        close(_fd);
+    }
+}
+
+const string Checkpoint::load(const string &durable)
+{
+    std::lock_guard<std::mutex> write_lock(_write_mutex);
+    if (_fd != -1)
+    {
+        return get_durable();
+    }
+
+    _fd = open(_path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (_fd == -1)
+    {
+        syslog(LOG_ERR, "Could not open %s: %s", _path.c_str(),
+               std::strerror(errno));
+        return "";
+    }
+
+    string journal;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(_fd, buffer, sizeof(buffer))) > 0)
+    {
+        journal.append(buffer, static_cast<std::size_t>(n));
+    }
+
+    string newest = valid(durable) ? durable : "";
+    std::uint32_t entries = 0;
+    std::size_t start = 0;
+    std::size_t end;
+    while ((end = journal.find('\n', start)) != string::npos)
+    {
+        const string id = journal.substr(start, end - start);
+        if (valid(id) && newer(id, newest))
+        {
+            newest = id;
+        }
+        ++entries;
+        start = end + 1;
+    }
+
+    // Cut off a line that was interrupted by a crash, so that the next entry
+    // starts on a line of its own.
+    if (start < journal.size())
+    {
+        syslog(LOG_WARNING, "Ignoring incomplete entry in %s.",
+               _path.c_str());
+        if (ftruncate(_fd, static_cast<off_t>(start)) != 0)
+        {
+            syslog(LOG_ERR, "Could not truncate %s: %s", _path.c_str(),
+                   std::strerror(errno));
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _newest = newest;
+        _durable = newest;
+        _entries = entries;
+        _running = true;
+    }
+
+    _thread = std::thread([this]
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (_running)
+        {
+            _cv.wait_for(lock, _interval, [this] { return !_running; });
+            lock.unlock();
+            flush();
+            lock.lock();
+            if (_entries >= _compact_after)
+            {
+                lock.unlock();
+                compact();
+                lock.lock();
+            }
+        }
+    });
+
+    return newest;
+}
+
+void Checkpoint::record(const string &id)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (newer(id, _newest))
+    {
+        _newest = id;
+        _buffer += id + '\n';
+    }
+}
+
+bool Checkpoint::flush()
+{
+    std::lock_guard<std::mutex> write_lock(_write_mutex);
+    string data;
+    string newest;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        data.swap(_buffer);
+        newest = _newest;
+    }
+    if (data.empty())
+    {
+        return true;
+    }
+
+    std::size_t written = 0;
+    while (_fd != -1 && written < data.size())
+    {
+        const ssize_t n = write(_fd, data.data() + written,
+                                data.size() - written);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1)
+        {
+            break;
+        }
+        written += static_cast<std::size_t>(n);
+    }
+
+    if (written < data.size() || fdatasync(_fd) != 0)
+    {
+        syslog(LOG_ERR, "Could not write %s: %s", _path.c_str(),
+               _fd == -1 ? "Not open" : std::strerror(errno));
+
+        // Try again next time. An entry that was written twice does no harm.
+        std::lock_guard<std::mutex> lock(_mutex);
+        _buffer.insert(0, data);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _durable = newest;
+    _entries += static_cast<std::uint32_t>(
+        std::count(data.begin(), data.end(), '\n'));
+
+    return true;
+}
+
+void Checkpoint::compact()
+{
+    std::lock_guard<std::mutex> write_lock(_write_mutex);
+    const string durable = get_durable();
+    if (_fd == -1 || durable.empty())
+    {
+        return;
+    }
+
+    // The journal may only shrink after the ID is safe elsewhere.
+    if (!_compact(durable))
+    {
+        syslog(LOG_ERR, "Could not compact %s.", _path.c_str());
+        return;
+    }
+    if (ftruncate(_fd, 0) != 0 || fdatasync(_fd) != 0)
+    {
+        syslog(LOG_ERR, "Could not truncate %s: %s", _path.c_str(),
+               std::strerror(errno));
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _entries = 0;
+}
+
+void Checkpoint::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _running = false;
+    }
+    _cv.notify_all();
+    if (_thread.joinable())
+    {
+        _thread.join();
+    }
+
+    flush();
+    bool entries;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        entries = _entries > 0;
+    }
+    if (entries)
+    {
+        compact();
+    }
+}
+
+const string Checkpoint::get_durable() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _durable;
+}
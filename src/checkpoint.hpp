@@ -0,0 +1,131 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include <string>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+
+using std::string;
+
+/*!
+ *  @brief  Append-only journal for the ID of the last processed notification
+ *
+ *          record() only appends the ID to a buffer. A background thread
+ *          writes the buffer to the journal and syncs it every `interval`, so
+ *          that many mentions share one fsync. After `compact_after` entries,
+ *          `compact` is called to write the newest ID somewhere else, for
+ *          example into the config file, and the journal is truncated.
+ *
+ *          An entry is only valid if it is complete; a line that was cut off
+ *          by a crash is ignored when the journal is loaded.
+ *
+ *          Example:
+ *  @code
+ *          Checkpoint checkpoint("last_id.journal", std::chrono::seconds(1),
+ *                                1000, [](const string &id)
+ *                                { return write_somewhere(id); });
+ *          const string last_id = checkpoint.load(config_last_id);
+ *          checkpoint.record(notif.id());
+ *  @endcode
+ */
+class Checkpoint
+{
+public:
+    /*!
+     *  @brief  Called with the newest durable ID to compact the journal
+     *
+     *  @return `true` if the ID is stored durably
+     */
+    using compactor = std::function<bool(const string &id)>;
+
+    /*!
+     *  @param  path            Path of the journal
+     *  @param  interval        Time between syncs
+     *  @param  compact_after   Number of entries that trigger a compaction
+     *  @param  compact         Stores the newest ID outside of the journal
+     */
+    explicit Checkpoint(const string &path,
+                        const std::chrono::milliseconds &interval,
+                        const std::uint32_t compact_after,
+                        const compactor &compact);
+    ~Checkpoint();
+
+    Checkpoint(const Checkpoint &) = delete;
+    Checkpoint &operator=(const Checkpoint &) = delete;
+
+    /*!
+     *  @brief  Reads the journal and starts the background thread
+     *
+     *  @param  durable An ID that is already stored durably elsewhere, like
+     *                  the result of the last compaction
+     *
+     *  @return The newest ID in the journal or `durable`, or an empty string
+     */
+    const string load(const string &durable = "");
+
+    /*!
+     *  @brief  Remembers `id`, if it is newer than all IDs before
+     */
+    void record(const string &id);
+
+    /*!
+     *  @brief  Writes and syncs all recorded IDs now
+     *
+     *  @return `false` if the journal could not be written
+     */
+    bool flush();
+
+    /*!
+     *  @brief  Stops the background thread, flushes and compacts
+     */
+    void stop();
+
+    /*!
+     *  @brief  Returns the newest ID that survives a crash
+     */
+    const string get_durable() const;
+
+private:
+    const string _path;
+    const std::chrono::milliseconds _interval;
+    const std::uint32_t _compact_after;
+    const compactor _compact;
+    int _fd;
+
+    // Recorded, but not written yet.
+    string _buffer;
+    string _newest;
+    string _durable;
+    std::uint32_t _entries;
+    mutable std::mutex _mutex;
+    // Only one thread writes to the journal at a time.
+    std::mutex _write_mutex;
+
+    std::thread _thread;
+    std::condition_variable _cv;
+    bool _running;
+
+    void compact();
+};
+
+#endif  // CHECKPOINT_HPP
@@ -0,0 +1,134 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <iterator>
+#include <syslog.h>
+#include "circuitbreaker.hpp"
+
+using std::string;
+using std::chrono::steady_clock;
+using std::chrono::duration_cast;
+using std::chrono::seconds;
+
+namespace
+{
+    // Hosts that failed once and were never asked again are forgotten when
+    // there are more than this.
+    constexpr std::size_t max_hosts = 4096;
+}
+
+CircuitBreaker::CircuitBreaker(const std::uint16_t max_failures,
+                               const std::chrono::milliseconds &retry_after)
+: _max_failures(max_failures > 0 ? max_failures : 1)
+, _retry_after(retry_after)
+, _tickets(0)
+, _refused(0)
+{}
+
+bool CircuitBreaker::allow(const string &host, std::uint64_t &ticket)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    ticket = 0;
+    auto it = _hosts.find(host);
+    if (it == _hosts.end() || !it->second.open)
+    {
+        return true;
+    }
+
+    host_state &h = it->second;
+    const steady_clock::time_point now = steady_clock::now();
+    if (now < h.retry_at)
+    {
+        ++_refused;
+        return false;
+    }
+
+    // Half-open. Until the probe is reported, everybody else is refused. If
+    // the report never comes, another probe is allowed after retry_after.
+    h.retry_at = now + _retry_after;
+    h.probe = ++_tickets;
+    ticket = h.probe;
+    syslog(LOG_INFO, "Probing %s.", host.c_str());
+
+    return true;
+}
+
+void CircuitBreaker::report(const string &host, const bool ok,
+                            const std::uint64_t ticket)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (ok)
+    {
+        auto it = _hosts.find(host);
+        if (it != _hosts.end())
+        {
+            if (it->second.open)
+            {
+                syslog(LOG_NOTICE, "%s is available again.", host.c_str());
+            }
+            _hosts.erase(it);
+        }
+        return;
+    }
+
+    if (_hosts.size() >= max_hosts && _hosts.find(host) == _hosts.end())
+    {
+        for (auto it = _hosts.begin(); it != _hosts.end();)
+        {
+            it = (it->second.open ? std::next(it) : _hosts.erase(it));
+        }
+    }
+
+    host_state &h = _hosts[host];
+    if (h.open)
+    {
+        if (ticket == 0 || ticket != h.probe)
+        {
+            // Started before the host was open, or a probe that took longer
+            // than retry_after and has been replaced.
+            return;
+        }
+        // The probe failed.
+        h.trips = static_cast<std::uint8_t>(std::min(h.trips + 1, 4));
+    }
+    else if (++h.failures < _max_failures)
+    {
+        return;
+    }
+
+    h.open = true;
+    h.probe = 0;
+    const auto wait = _retry_after * (1 << h.trips);
+    h.retry_at = steady_clock::now() + wait;
+    syslog(LOG_WARNING, "%s is unavailable, trying again in %ld s.",
+           host.c_str(), static_cast<long>(duration_cast<seconds>(wait).count()));
+}
+
+std::size_t CircuitBreaker::get_unavailable() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    return static_cast<std::size_t>(
+        std::count_if(_hosts.begin(), _hosts.end(),
+                      [](const std::pair<const string, host_state> &h)
+                      { return h.second.open; }));
+}
+
+std::uint64_t CircuitBreaker::get_refused() const
+{
+    return _refused;
+}
@@ -0,0 +1,120 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CIRCUITBREAKER_HPP
+#define CIRCUITBREAKER_HPP
+
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+using std::string;
+
+/*!
+ *  @brief  Keeps track of hosts that fail, so that they are not asked again
+ *          and again
+ *
+ *          Every host starts out closed: requests are allowed. After
+ *          `max_failures` failed requests in a row, the host is open and
+ *          requests are refused for `retry_after`. Then it is half-open: one
+ *          probe request is allowed. If it succeeds, the host is closed again,
+ *          if not, it stays open for twice as long as before, up to 16 times
+ *          `retry_after`.
+ *
+ *          Thread-safe.
+ *
+ *          Example:
+ *  @code
+ *          CircuitBreaker breaker(3, std::chrono::seconds(30));
+ *          std::uint64_t ticket;
+ *          if (breaker.allow(host, ticket))
+ *          {
+ *              breaker.report(host, request(url), ticket);
+ *          }
+ *  @endcode
+ */
+class CircuitBreaker
+{
+public:
+    /*!
+     *  @param  max_failures    Failures in a row after which a host is open
+     *  @param  retry_after     Time until the first probe request
+     */
+    explicit CircuitBreaker(const std::uint16_t max_failures,
+                            const std::chrono::milliseconds &retry_after);
+
+    /*!
+     *  @brief  Returns `true` if a request to `host` may be made
+     *
+     *          If it returns `true` for a half-open host, the caller makes the
+     *          probe request and must call report().
+     *
+     *  @param  host    The host
+     *  @param  ticket  Set to the number of the probe, or 0 if the request
+     *                  is not a probe. Pass it to report().
+     */
+    bool allow(const string &host, std::uint64_t &ticket);
+
+    /*!
+     *  @brief  Reports the outcome of a request to `host`
+     *
+     *          While the host is open, only the failure of the probe counts.
+     *          Requests that were made before the host became unavailable
+     *          can not make it wait longer.
+     *
+     *  @param  host    The host
+     *  @param  ok      `false` if the host did not answer or had an error
+     *  @param  ticket  What allow() returned for the request
+     */
+    void report(const string &host, const bool ok, const std::uint64_t ticket);
+
+    /*!
+     *  @brief  Returns the number of hosts that are not closed
+     */
+    std::size_t get_unavailable() const;
+
+    /*!
+     *  @brief  Returns the number of requests that were refused
+     */
+    std::uint64_t get_refused() const;
+
+private:
+    struct host_state
+    {
+        std::uint16_t failures = 0;
+        //! Number of failed probes in a row
+        std::uint8_t trips = 0;
+        bool open = false;
+        //! Ticket of the running probe, 0 if there is none
+        std::uint64_t probe = 0;
+        //! When the next probe may be made
+        std::chrono::steady_clock::time_point retry_at;
+    };
+
+    const std::uint16_t _max_failures;
+    const std::chrono::milliseconds _retry_after;
+    // Only hosts that failed recently, the others are closed.
+    std::unordered_map<string, host_state> _hosts;
+    mutable std::mutex _mutex;
+    //! Last ticket that was handed out for a probe
+    std::uint64_t _tickets;
+    std::atomic<std::uint64_t> _refused;
+};
+
+#endif  // CIRCUITBREAKER_HPP
@@ -18,6 +18,10 @@
 #include <experimental/filesystem>
 #include <basedir.h>
 #include <sstream>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
 #include "configjson.hpp"
 
 using std::string;
@@ -62,19 +66,50 @@ bool ConfigJSON::read()
 
 bool ConfigJSON::write()
 {
-    std::ofstream file(_filepath);
-    if (file.is_open())
+    // Write to a temporary file and rename it, so that a crash leaves either
+    // the old or the new file behind.
+    const string tmp = _filepath + ".tmp";
+    const int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        0600);
+    if (fd == -1)
     {
-        const string config = _json.toStyledString();
-        file.write(config.c_str(), config.length());
-        file.close();
+        return false;
+    }
 
-        return true;
+    const string config = _json.toStyledString();
+    std::size_t written = 0;
+    while (written < config.length())
+    {
+        const ssize_t n = ::write(fd, config.c_str() + written,
+                                  config.length() - written);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1)
+        {
+            break;
+        }
+        written += static_cast<std::size_t>(n);
     }
-    else
+    const bool ok = written == config.length() && fsync(fd) == 0;
+    close(fd);
+    if (!ok || std::rename(tmp.c_str(), _filepath.c_str()) != 0)
     {
+        std::remove(tmp.c_str());
         return false;
     }
+
+    // Make the rename itself durable.
+    const int dir = open(fs::path(_filepath).parent_path().c_str(),
+                         O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir != -1)
+    {
+        fsync(dir);
+        close(dir);
+    }
+
+    return true;
 }
 
 Json::Value &ConfigJSON::get_json()
@@ -48,6 +48,9 @@ public:
     /*!
      *  @brief  Write the file
      *
+     *          The file is replaced atomically, it is never left half
+     *          written.
+     *
      *  @return `true` on success
      */
     bool write();
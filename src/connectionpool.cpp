@@ -0,0 +1,121 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "connectionpool.hpp"
+
+using std::string;
+
+namespace
+{
+    // Handles beyond this are cleaned up instead of kept.
+    constexpr std::size_t max_idle_handles = 64;
+}
+
+ConnectionPool::ConnectionPool(const std::uint16_t max_host_requests)
+: _share(curl_share_init())
+, _max_host_requests(max_host_requests > 0 ? max_host_requests : 1)
+{
+    curl_share_setopt(_share, CURLSHOPT_LOCKFUNC, lock);
+    curl_share_setopt(_share, CURLSHOPT_UNLOCKFUNC, unlock);
+    curl_share_setopt(_share, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    // Connections are not shared: the Expanders run their multi handles in
+    // different threads, which libcurl does not support for the connection
+    // cache. Each multi handle keeps its own.
+}
+
+ConnectionPool::~ConnectionPool()
+{
+    for (CURL *handle : _idle)
+    {
+        curl_easy_cleanup(handle);
+    }
+    curl_share_cleanup(_share);
+}
+
+void ConnectionPool::lock(CURL *, curl_lock_data data, curl_lock_access,
+                          void *pool)
+{
+    static_cast<ConnectionPool*>(pool)->_share_mutexes[data].lock();
+}
+
+void ConnectionPool::unlock(CURL *, curl_lock_data data, void *pool)
+{
+    static_cast<ConnectionPool*>(pool)->_share_mutexes[data].unlock();
+}
+
+CURL *ConnectionPool::acquire()
+{
+    {
+        std::lock_guard<std::mutex> lock(_idle_mutex);
+        if (!_idle.empty())
+        {
+            CURL *handle = _idle.back();
+            _idle.pop_back();
+            return handle;
+        }
+    }
+
+    CURL *handle = curl_easy_init();
+    curl_easy_setopt(handle, CURLOPT_SHARE, _share);
+
+    return handle;
+}
+
+void ConnectionPool::release(CURL *handle)
+{
+    std::lock_guard<std::mutex> lock(_idle_mutex);
+    if (_idle.size() < max_idle_handles)
+    {
+        _idle.push_back(handle);
+    }
+    else
+    {
+        curl_easy_cleanup(handle);
+    }
+}
+
+bool ConnectionPool::acquire_host(const string &host)
+{
+    std::lock_guard<std::mutex> lock(_host_mutex);
+    std::uint16_t &requests = _host_requests[host];
+    if (requests >= _max_host_requests)
+    {
+        return false;
+    }
+    ++requests;
+
+    return true;
+}
+
+void ConnectionPool::release_host(const string &host)
+{
+    std::lock_guard<std::mutex> lock(_host_mutex);
+    auto it = _host_requests.find(host);
+    if (it != _host_requests.end())
+    {
+        if (--it->second == 0)
+        {
+            _host_requests.erase(it);
+        }
+    }
+}
+
+std::uint16_t ConnectionPool::get_max_host_requests() const
+{
+    return _max_host_requests;
+}
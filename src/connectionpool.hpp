@@ -0,0 +1,106 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONNECTIONPOOL_HPP
+#define CONNECTIONPOOL_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <array>
+#include <mutex>
+#include <cstdint>
+#include <curl/curl.h>
+
+using std::string;
+
+/*!
+ *  @brief  Reusable curl handles and state shared between all of them
+ *
+ *          The DNS cache and TLS sessions are shared between all handles, so
+ *          that following requests to the same host skip the lookup and the
+ *          full handshake. Open connections are kept by the multi handle of
+ *          each Expander. The pool also limits the number of simultaneous
+ *          requests per host.
+ *
+ *          Thread-safe. One pool is meant to be used by all Expanders.
+ *
+ *          Example:
+ *  @code
+ *          ConnectionPool pool(2);
+ *          CURL *handle = pool.acquire();
+ *          if (pool.acquire_host("bit.ly")) { … pool.release_host("bit.ly"); }
+ *          pool.release(handle);
+ *  @endcode
+ */
+class ConnectionPool
+{
+public:
+    /*!
+     *  @param  max_host_requests   Maximum number of simultaneous requests
+     *                              per host
+     */
+    explicit ConnectionPool(const std::uint16_t max_host_requests = 2);
+    ~ConnectionPool();
+
+    ConnectionPool(const ConnectionPool &) = delete;
+    ConnectionPool &operator=(const ConnectionPool &) = delete;
+
+    /*!
+     *  @brief  Returns an idle handle or a new one, attached to the share
+     *
+     *          Options set by the previous user are not reset.
+     */
+    CURL *acquire();
+
+    /*!
+     *  @brief  Gives a handle back to the pool
+     */
+    void release(CURL *handle);
+
+    /*!
+     *  @brief  Reserves a request slot for `host`
+     *
+     *  @return `false` if the maximum number of requests for `host` is
+     *          reached
+     */
+    bool acquire_host(const string &host);
+
+    /*!
+     *  @brief  Frees a request slot reserved with acquire_host()
+     */
+    void release_host(const string &host);
+
+    /*!
+     *  @brief  Returns the maximum number of simultaneous requests per host
+     */
+    std::uint16_t get_max_host_requests() const;
+
+private:
+    CURLSH *_share;
+    std::array<std::mutex, CURL_LOCK_DATA_LAST> _share_mutexes;
+    std::vector<CURL*> _idle;
+    std::mutex _idle_mutex;
+    std::map<string, std::uint16_t> _host_requests;
+    std::mutex _host_mutex;
+    const std::uint16_t _max_host_requests;
+
+    static void lock(CURL *, curl_lock_data data, curl_lock_access,
+                     void *pool);
+    static void unlock(CURL *, curl_lock_data data, void *pool);
+};
+
+#endif  // CONNECTIONPOOL_HPP
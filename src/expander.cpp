@@ -0,0 +1,360 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <thread>
+#include <syslog.h>
+#include "version.hpp"
+#include "urlparts.hpp"
+#include "expander.hpp"
+
+using std::string;
+using std::chrono::steady_clock;
+using std::chrono::milliseconds;
+using std::chrono::duration_cast;
+
+// State of the redirect chain of one URL.
+struct Expander::transfer
+{
+    expand_result *result;
+    //! Index in the URLs passed to expand()
+    std::size_t index;
+    steady_clock::time_point deadline;
+    //! URL of the current hop
+    string url;
+    //! Host of the current hop
+    string host;
+    //! The current hop is a GET request
+    bool get;
+    //! We cancelled the GET request after the headers
+    bool aborted;
+    //! Ticket from the circuit breaker for the current hop
+    std::uint64_t ticket;
+    std::uint8_t redirects;
+};
+
+Expander::Expander(ConnectionPool &pool, const expander_options &options)
+: _pool(pool)
+, _multi(curl_multi_init())
+{
+    curl_multi_setopt(_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(_multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+                      static_cast<long>(_pool.get_max_host_requests()));
+    set_options(options);
+}
+
+Expander::~Expander()
+{
+    curl_multi_cleanup(_multi);
+}
+
+void Expander::set_options(const expander_options &options)
+{
+    _options = options;
+    if (_options.max_concurrent == 0)
+    {
+        _options.max_concurrent = 1;
+    }
+    curl_multi_setopt(_multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                      static_cast<long>(_options.max_concurrent));
+}
+
+CURL *Expander::make_handle(transfer &t) const
+{
+    static const string useragent =
+        static_cast<const string>("expandurl-mastodon/") + global::version;
+    CURL *handle = _pool.acquire();
+
+    // HEAD requests should have no body, but some servers send one anyway.
+    // The body of GET requests is not needed, we only want the headers.
+    const curl_write_callback writer =
+        [](char *, std::size_t size, std::size_t nmemb, void *userdata)
+        -> std::size_t
+        {
+            transfer *tr = static_cast<transfer*>(userdata);
+            if (tr->get)
+            {
+                tr->aborted = true;
+                return 0;
+            }
+
+            return size * nmemb;
+        };
+
+    curl_easy_setopt(handle, CURLOPT_USERAGENT, useragent.c_str());
+    curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 0L);
+    curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, writer);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, &t);
+    curl_easy_setopt(handle, CURLOPT_PRIVATE, &t);
+
+    return handle;
+}
+
+void Expander::start_hop(transfer &t, CURL *handle, const string &url,
+                         const bool get)
+{
+    t.url = url;
+    t.host = get_host(url);
+    t.get = get;
+    t.aborted = false;
+    t.ticket = 0;
+
+    curl_easy_setopt(handle, CURLOPT_URL, t.url.c_str());
+    // Rather wait for a connection that can be multiplexed than open another.
+    // HTTP/2 is only used with TLS, don't wait for plain HTTP connections.
+    curl_easy_setopt(handle, CURLOPT_PIPEWAIT,
+                     (url.compare(0, 8, "https://") == 0 ? 1L : 0L));
+    if (get)
+    {
+        curl_easy_setopt(handle, CURLOPT_HTTPGET, 1L);
+        curl_easy_setopt(handle, CURLOPT_RANGE, "0-0");
+    }
+    else
+    {
+        curl_easy_setopt(handle, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(handle, CURLOPT_RANGE, nullptr);
+    }
+
+    _waiting.emplace_back(&t, handle);
+}
+
+std::uint16_t Expander::launch_waiting()
+{
+    std::uint16_t expired = 0;
+
+    for (auto it = _waiting.begin(); it != _waiting.end();)
+    {
+        transfer &t = *it->first;
+        CURL *handle = it->second;
+        const long remaining = static_cast<long>(duration_cast<milliseconds>
+            (t.deadline - steady_clock::now()).count());
+
+        if (remaining <= 0)
+        {
+            syslog(LOG_NOTICE, "Deadline reached while waiting for %s.",
+                   t.host.c_str());
+            t.result->ok = false;
+            _pool.release(handle);
+            finish(t);
+            ++expired;
+        }
+        else if (_pool.acquire_host(t.host))
+        {
+            // Ask as late as possible, so that a half-open host gets its
+            // probe request only when it can be made.
+            if (_options.breaker != nullptr
+                && !_options.breaker->allow(t.host, t.ticket))
+            {
+                syslog(LOG_DEBUG, "%s is unavailable, not requesting %s.",
+                       t.host.c_str(), t.url.c_str());
+                _pool.release_host(t.host);
+                t.result->url = t.url;
+                t.result->ok = false;
+                t.result->unavailable = true;
+                _pool.release(handle);
+                finish(t);
+                ++expired;
+            }
+            else
+            {
+                curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, remaining);
+                curl_multi_add_handle(_multi, handle);
+            }
+        }
+        else
+        {
+            ++it;
+            continue;
+        }
+        it = _waiting.erase(it);
+    }
+
+    return expired;
+}
+
+bool Expander::finish_hop(transfer &t, CURL *handle, const CURLcode result)
+{
+    long code = 0;
+    char *location = nullptr;
+    double total_time = 0;
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code);
+    curl_easy_getinfo(handle, CURLINFO_REDIRECT_URL, &location);
+    curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME, &total_time);
+    // location points into handle, copy it before the handle is reused.
+    const string next = (location != nullptr ? location : "");
+    curl_multi_remove_handle(_multi, handle);
+    _pool.release_host(t.host);
+
+    const milliseconds latency(static_cast<long>(total_time * 1000));
+    t.result->hops.push_back({ t.url, code, t.get, latency });
+    t.result->url = t.url;
+    syslog(LOG_DEBUG, "%s %s: %ld in %ld ms", (t.get ? "GET" : "HEAD"),
+           t.url.c_str(), code, static_cast<long>(latency.count()));
+
+    if (result != CURLE_OK && !(t.aborted && result == CURLE_WRITE_ERROR))
+    {
+        syslog(LOG_ERR, "%s: %s", t.url.c_str(), curl_easy_strerror(result));
+        if (_options.breaker != nullptr)
+        {
+            _options.breaker->report(t.host, false, t.ticket);
+        }
+        t.result->ok = false;
+        return false;
+    }
+    // 501 means the server does not like HEAD requests, see below.
+    if (_options.breaker != nullptr)
+    {
+        _options.breaker->report(t.host, code < 500 || code == 501,
+                                 t.ticket);
+    }
+
+    const bool time_left = (steady_clock::now() < t.deadline);
+
+    // Some servers do not like HEAD requests.
+    if (!t.get && (code == 403 || code == 405 || code == 501))
+    {
+        if (time_left)
+        {
+            start_hop(t, handle, t.url, true);
+            return true;
+        }
+        t.result->ok = false;
+        return false;
+    }
+
+    if (code >= 300 && code < 400 && !next.empty())
+    {
+        if (t.redirects >= _options.max_hops)
+        {
+            syslog(LOG_NOTICE, "Too many redirects, stopping at %s.",
+                   t.url.c_str());
+            return false;
+        }
+        if (host_matches(get_host(next), _options.final_domains))
+        {
+            t.result->url = next;
+            return false;
+        }
+        if (!time_left)
+        {
+            syslog(LOG_NOTICE, "Deadline reached, stopping at %s.",
+                   t.url.c_str());
+            t.result->url = next;
+            t.result->ok = false;
+            return false;
+        }
+
+        ++t.redirects;
+        start_hop(t, handle, next, false);
+        return true;
+    }
+
+    return false;
+}
+
+void Expander::finish(const transfer &t) const
+{
+    if (_finished)
+    {
+        _finished(t.index, *t.result);
+    }
+}
+
+const std::vector<expand_result> Expander::expand(
+    const std::vector<string> &urls, const result_handler &finished)
+{
+    _finished = finished;
+    std::vector<expand_result> expanded;
+    std::vector<transfer> transfers(urls.size());
+    std::size_t next = 0;
+    std::uint16_t active = 0;
+    int still_running = 0;
+
+    expanded.reserve(urls.size());
+    for (const string &url : urls)
+    {
+        expanded.push_back({ url, true, {} });
+    }
+
+    do
+    {
+        // Keep at most max_concurrent transfers in flight.
+        while (next < urls.size() && active < _options.max_concurrent)
+        {
+            const std::size_t index = next++;
+            transfer &t = transfers[index];
+            t.result = &expanded[index];
+            t.index = index;
+            if (host_matches(get_host(urls[index]), _options.final_domains))
+            {
+                finish(t);
+                continue;
+            }
+
+            t.deadline = steady_clock::now() + _options.deadline;
+            t.redirects = 0;
+            start_hop(t, make_handle(t), urls[index], false);
+            ++active;
+        }
+
+        active -= launch_waiting();
+        curl_multi_perform(_multi, &still_running);
+
+        CURLMsg *msg;
+        int msgs_left;
+        bool finished = false;
+        while ((msg = curl_multi_info_read(_multi, &msgs_left)))
+        {
+            if (msg->msg != CURLMSG_DONE)
+            {
+                continue;
+            }
+
+            CURL *handle = msg->easy_handle;
+            const CURLcode result = msg->data.result;
+            finished = true;
+            void *priv = nullptr;
+            curl_easy_getinfo(handle, CURLINFO_PRIVATE, &priv);
+
+            transfer &t = *static_cast<transfer*>(priv);
+            if (!finish_hop(t, handle, result))
+            {
+                _pool.release(handle);
+                finish(t);
+                --active;
+            }
+        }
+
+        // Follow-up hops are launched at the top of the loop, don't wait
+        // before that.
+        if (active > 0 && !finished)
+        {
+            int numfds = 0;
+            curl_multi_wait(_multi, nullptr, 0, 1000, &numfds);
+            // curl_multi_wait() returns at once if there is nothing to wait
+            // for, which happens if all hops wait for a host slot.
+            if (numfds == 0 && still_running == 0 && !_waiting.empty())
+            {
+                std::this_thread::sleep_for(milliseconds(10));
+            }
+        }
+    }
+    while (active > 0 || next < urls.size());
+    _finished = nullptr;
+
+    return expanded;
+}
@@ -0,0 +1,171 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EXPANDER_HPP
+#define EXPANDER_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <utility>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <curl/curl.h>
+#include "connectionpool.hpp"
+#include "circuitbreaker.hpp"
+
+using std::string;
+
+/*!
+ *  @brief  One request of a redirect chain
+ */
+struct expand_hop
+{
+    string url;
+    //! HTTP status code, 0 if the request failed
+    long code;
+    //! `true` if a ranged GET was used instead of HEAD
+    bool get;
+    std::chrono::milliseconds latency;
+};
+
+/*!
+ *  @brief  Result of an expansion
+ */
+struct expand_result
+{
+    //! The expanded URL, or the last URL that was reached
+    string url;
+    //! `false` if the transfer failed
+    bool ok;
+    //! All requests that were made, in order
+    std::vector<expand_hop> hops;
+    //! `true` if a host was unavailable and the request was not made
+    bool unavailable = false;
+};
+
+/*!
+ *  @brief  Settings for Expander
+ */
+struct expander_options
+{
+    //! Maximum number of simultaneous transfers
+    std::uint16_t max_concurrent = 8;
+    //! Maximum number of redirects that are followed per URL
+    std::uint8_t max_hops = 10;
+    //! Time limit for the whole redirect chain of one URL
+    std::chrono::milliseconds deadline = std::chrono::seconds(30);
+    //! Redirects are not followed into these domains and their subdomains
+    std::vector<string> final_domains;
+    //! Requests to hosts that it refuses fail at once. Can be shared.
+    CircuitBreaker *breaker = nullptr;
+};
+
+/*!
+ *  @brief  Expands many URLs in parallel, using the curl multi interface
+ *
+ *          All transfers of one call to expand() run on the same event loop.
+ *          Redirects are followed hop by hop. If a server rejects HEAD
+ *          requests, a GET request for the first byte is sent instead and
+ *          cancelled as soon as the headers have arrived.
+ *
+ *          Handles, TLS sessions and the DNS cache come from a
+ *          ConnectionPool, which also limits the requests per host. Open
+ *          connections are kept between calls to expand(). Requests
+ *          for hosts that are at the limit wait until a slot is free. HTTP/2
+ *          is used if the server supports it, requests to the same host are
+ *          multiplexed then.
+ *
+ *          If a CircuitBreaker is set in the options, requests to hosts that
+ *          failed repeatedly are not made. The chain ends at the URL that
+ *          would have been requested, and the result is not `ok`.
+ *
+ *          Not thread-safe, use one instance per thread. The ConnectionPool
+ *          can be shared.
+ *
+ *          Example:
+ *  @code
+ *          ConnectionPool pool(2);
+ *          expander_options options;
+ *          options.max_hops = 5;
+ *          Expander expander(pool, options);
+ *          const std::vector<expand_result> expanded = expander.expand(urls);
+ *  @endcode
+ */
+class Expander
+{
+public:
+    explicit Expander(ConnectionPool &pool,
+                      const expander_options &options = expander_options());
+    ~Expander();
+
+    Expander(const Expander &) = delete;
+    Expander &operator=(const Expander &) = delete;
+
+    /*!
+     *  @brief  Called as soon as the expansion of `urls[index]` is finished
+     */
+    using result_handler = std::function<void(const std::size_t index,
+                                              const expand_result &result)>;
+
+    /*!
+     *  @brief  Expands all URLs concurrently
+     *
+     *          URLs from several statuses can be passed at once.
+     *
+     *  @param  urls        URLs to expand
+     *  @param  finished    Is called for every URL when it is done, from the
+     *                      calling thread, optional
+     *
+     *  @return Expanded URLs, in the same order as `urls`. If a transfer
+     *          fails, the last URL that was reached is returned.
+     */
+    const std::vector<expand_result> expand(
+        const std::vector<string> &urls,
+        const result_handler &finished = result_handler());
+
+    /*!
+     *  @brief  Replaces the settings
+     */
+    void set_options(const expander_options &options);
+
+private:
+    struct transfer;
+
+    ConnectionPool &_pool;
+    CURLM *_multi;
+    expander_options _options;
+    //! Hops that wait for a free slot for their host
+    std::deque<std::pair<transfer*, CURL*>> _waiting;
+    //! The handler of the running expand()
+    result_handler _finished;
+
+    CURL *make_handle(transfer &t) const;
+    void start_hop(transfer &t, CURL *handle, const string &url,
+                   const bool get);
+    /*!
+     *  @brief  Starts waiting hops if their host has a free slot
+     *
+     *  @return Number of chains that ended while waiting, because they ran
+     *          out of time or the host is unavailable
+     */
+    std::uint16_t launch_waiting();
+    bool finish_hop(transfer &t, CURL *handle, const CURLcode result);
+    void finish(const transfer &t) const;
+};
+
+#endif  // EXPANDER_HPP
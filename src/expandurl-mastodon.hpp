@@ -20,12 +20,27 @@
 #include <string>
 #include <memory>
 #include <thread>
+#include <mutex>
 #include <vector>
+#include <set>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <regex>
+#include <curl/curl.h>
 #include <mastodon-cpp/mastodon-cpp.hpp>
 #include <mastodon-cpp/easy/all.hpp>
 #include <jsoncpp/json/json.h>
 #include "configjson.hpp"
+#include "shorteners.hpp"
+#include "sseparser.hpp"
+#include "statuscache.hpp"
+#include "ratelimiter.hpp"
+#include "checkpoint.hpp"
+#include "expander.hpp"
+#include "urlfilter.hpp"
 
 using namespace Mastodon;
 
@@ -33,16 +48,76 @@ using std::string;
 using Mastodon::API;
 
 extern ConfigJSON configfile;
+//! Held while configfile is changed or written, by all threads
+extern std::mutex config_mutex;
 
 void signal_handler(int signum);
 
 /*!
- *  @brief  Extract URLs from HTML
+ *  @brief  A compiled replacement rule
+ */
+struct replacement
+{
+    std::regex re;
+    string replace;
+};
+
+/*!
+ *  @brief  All replacement rules
+ *
+ *          Rules that remove query parameters or rewrite hosts and paths are
+ *          applied by `filter` in one pass, the others are regular
+ *          expressions that are applied after it. Only the rules before the
+ *          first regular expression go into `filter`, so that the order of
+ *          the rules does not change.
+ */
+struct replacements
+{
+    URLFilter filter;
+    std::vector<replacement> regexes;
+};
+
+/*!
+ *  @brief  Extract URLs from HTML, expand and filter them
+ *
+ *          URLs that are not likely to redirect are only filtered. All other
+ *          URLs are expanded concurrently.
  *
  *  @return vector of URLs
  */
 const std::vector<string> get_urls(const string &html);
 
+/*!
+ *  @brief  Like get_urls(), but returns at `deadline` at the latest
+ *
+ *          URLs that are not expanded by then are only filtered. Their
+ *          expansion goes on in the background and is cached.
+ *
+ *  @param  html        The HTML
+ *  @param  deadline    When the URLs are needed
+ *  @param  complete    Is set to `false` if URLs were not expanded in time
+ *
+ *  @return vector of URLs
+ */
+const std::vector<string> get_urls(
+    const string &html, const std::chrono::steady_clock::time_point &deadline,
+    bool &complete);
+
+/*!
+ *  @brief  Waits for the expansions that get_urls() left in the background
+ */
+void finish_expansions();
+
+/*!
+ *  @brief  Returns the CircuitBreaker used for expanding URLs
+ */
+CircuitBreaker &get_circuit_breaker();
+
+/*!
+ *  @brief  Returns the HostClassifier used by get_urls()
+ */
+HostClassifier &get_classifier();
+
 /*!
  *  @brief  Expands shortened URLs
  *
@@ -52,6 +127,44 @@ const std::vector<string> get_urls(const string &html);
  */
 const string expand(const string &url);
 
+/*!
+ *  @brief  Expands URLs concurrently in this process, with the settings from
+ *          the config file
+ *
+ *          Used by the expander worker processes.
+ */
+const std::vector<expand_result> expand_urls(const std::vector<string> &urls);
+
+/*!
+ *  @brief  Extracts the target of wrapper URLs, without network access
+ *
+ *          Wrapper URLs contain their target in the query or the path, like
+ *          `https://www.google.com/url?q=…`. Wrappers inside wrappers are
+ *          unwrapped too.
+ *
+ *  @param  url     URL to unwrap
+ *
+ *  @return The target, or `url` if it is not a wrapper
+ */
+const string unwrap(const string &url);
+
+/*!
+ *  @brief  Initialize the rules for unwrap()
+ *
+ *          If no rules are found in the config file, a default list is
+ *          inserted. Invalid rules are skipped.
+ */
+void init_unwrap_rules();
+
+/*!
+ *  @brief  Use new rules for unwrap()
+ *
+ *  @param  unwrap  The `unwrap` array of the config file
+ *
+ *  @return `false` if a rule is invalid. The old rules are kept in that case.
+ */
+bool reload_unwrap_rules(const Json::Value &unwrap);
+
 /*!
  *  @brief  Filters out tracking stuff
  *
@@ -67,16 +180,44 @@ const string strip(const string &url);
  *  @brief  Initialize replacements for URLs
  *
  *          If no replacements are found in the config file, a default list is
- *          inserted.
+ *          inserted. The replacements are compiled, invalid patterns are
+ *          skipped.
  *
  */
 void init_replacements();
 
+/*!
+ *  @brief  Compile new replacements and use them for all following URLs
+ *
+ *          URLs that are currently being filtered keep the old replacements.
+ *
+ *  @param  replace The `replace` object of the config file
+ *
+ *  @return `false` if a pattern is invalid. The old replacements are kept in
+ *          that case.
+ */
+bool reload_replacements(const Json::Value &replace);
+
 
+/*!
+ *  @brief  Connection to Mastodon
+ *
+ *          get_status(), send_reply() and get_parent_id() can be called from
+ *          several threads at once. All API calls respect the rate limit of
+ *          the instance, replies have priority.
+ *
+ *          There is one listener per account. The settings of the account are
+ *          read from `config`, everything else from the config file.
+ */
 class Listener
 {
 public:
-    Listener();
+    /*!
+     *  @param  config  The settings of the account: the config file, or an
+     *                  element of its `accounts` array. Must stay valid.
+     *  @param  journal Path of the checkpoint journal for last_id
+     */
+    explicit Listener(Json::Value &config, const string &journal);
     ~Listener();
 
     /*!
@@ -88,31 +229,210 @@ public:
      */
     void stop();
 
+    /*!
+     *  @brief  Blocks until new data arrives on the stream, the stream ends,
+     *          wake() is called or the timeout expires
+     *
+     *  @return `false` if the timeout expired
+     */
+    bool wait(const std::chrono::milliseconds &timeout);
+
+    /*!
+     *  @brief  Wakes up wait(). Safe to call from signal handlers.
+     */
+    void wake() const;
+
+    /*!
+     *  @brief  Called for each mention found by catchup()
+     *
+     *  @return `false` to stop catching up
+     */
+    using notification_handler =
+        std::function<bool(const Easy::Notification &notif)>;
+
     const std::vector<Easy::Notification> get_new_messages();
-    const std::vector<Easy::Notification> catchup();
+
+    /*!
+     *  @brief  Returns the ID of the last processed mention and keeps
+     *          last_id from moving past it until catchup() found all
+     *          mentions after it
+     *
+     *          Call it before live mentions of a new connection are pushed.
+     *
+     *  @return The ID for catchup(), or an empty string
+     */
+    const string begin_catchup();
+
+    /*!
+     *  @brief  Fetches all mentions after `since`
+     *
+     *          Pages through the notifications from the oldest to the newest
+     *          and calls `handler` as soon as a page arrives. Mentions that
+     *          were already returned by get_new_messages() or an earlier
+     *          catchup() are skipped. Can run in its own thread.
+     *
+     *  @param  since   What begin_catchup() returned
+     *
+     *  @return `false` if a page could not be fetched
+     */
+    bool catchup(const string &since, const notification_handler &handler);
+
     Easy::Status get_status(const string &id);
     bool send_reply(const Easy::Status &to_status, const string &message);
-    const string get_parent_id(const Easy::Notification &notif);
+
+    /*!
+     *  @brief  Returns the ID of the post `notif` replies to
+     *
+     *  @param  notif   The mention
+     *  @param  retry   Is set to `true` if the ID is not known yet, but may
+     *                  be later
+     *
+     *  @return The ID, or an empty string
+     */
+    const string get_parent_id(const Easy::Notification &notif, bool &retry);
+
+    /*!
+     *  @brief  Marks the mention with the notification ID `id` as being
+     *          processed
+     *
+     *          last_id does not move past it until mention_done() is called.
+     */
+    void mention_started(const string &id);
+
+    /*!
+     *  @brief  Marks the mention as processed, after the reply was sent
+     *
+     *          last_id is moved to the newest processed mention that is older
+     *          than all mentions still being processed.
+     */
+    void mention_done(const string &id);
 
     bool stillrunning() const;
 
+    /*!
+     *  @brief  Returns the address of the account, username@instance
+     */
+    const string get_account() const;
+
+    /*!
+     *  @brief  Returns `true` if the server answered the last connection
+     *          attempt with an HTTP error
+     */
+    bool stream_failed() const;
+
+    /*!
+     *  @brief  Returns the cache used by get_status() and get_parent_id()
+     */
+    const StatusCache &get_status_cache() const;
+
+    /*!
+     *  @brief  Returns the scheduler all API calls go through
+     */
+    const RateLimiter &get_rate_limiter() const;
+
+    /*!
+     *  @brief  Returns when data, including keep-alive packets, arrived last
+     */
+    std::chrono::steady_clock::time_point get_last_activity() const;
+
+    /*!
+     *  @brief  Returns the bytes used by incomplete lines and queued events
+     */
+    std::size_t get_stream_memory_usage() const;
+
+    /*!
+     *  @brief  Returns the number of events that were dropped because they
+     *          had a line that was too long
+     */
+    std::uint64_t get_dropped_events() const;
+
 private:
+    string _account;
     string _instance;
     string _access_token;
     std::unique_ptr<Easy::API> _masto;
-    string _stream;
-    std::unique_ptr<API::http> _ptr;
+    SSEParser _parser;
     std::thread _thread;
-    bool _running;
+    std::atomic<bool> _running;
+    std::atomic<bool> _cancel;
+    std::atomic<bool> _failed;
+    int _wakeup_fd;
     string _proxy;
     string _proxy_user;
     string _proxy_password;
     Json::Value &_config;
 
+    std::vector<std::unique_ptr<Easy::API>> _api_pool;
+    std::mutex _api_mutex;
+    StatusCache _statuses;
+    RateLimiter _limiter;
+    // Persists last_id between config writes. Only IDs from mention_done()
+    // are recorded.
+    Checkpoint _checkpoint;
+
+    // Notification IDs are numbers of arbitrary length.
+    struct id_order
+    {
+        bool operator()(const string &a, const string &b) const;
+    };
+    // Mentions that are being processed, and processed mentions that are
+    // newer than one of them.
+    std::set<string, id_order> _in_flight;
+    std::set<string, id_order> _done;
+    std::mutex _in_flight_mutex;
+
+    // IDs of recent notifications, to skip duplicates.
+    static constexpr std::size_t max_seen = 1024;
+    std::set<string> _seen;
+    std::deque<string> _seen_order;
+    std::mutex _seen_mutex;
+
+    /*!
+     *  @brief  Borrows an API object from the pool for one thread
+     */
+    class api_lease
+    {
+    public:
+        explicit api_lease(Listener &listener);
+        ~api_lease();
+        Easy::API *operator->();
+
+    private:
+        Listener &_listener;
+        std::unique_ptr<Easy::API> _api;
+    };
+
     void read_config();
+    /*!
+     *  @brief  Receives the stream, runs in _thread
+     */
+    void stream();
+    static std::size_t stream_writer(char *data, std::size_t size,
+                                     std::size_t nmemb, void *listener);
+    static int stream_progress(void *listener, curl_off_t, curl_off_t,
+                               curl_off_t, curl_off_t);
     bool write_config();
     bool register_app();
     void set_proxy(Easy::API &masto);
+    std::unique_ptr<Easy::API> make_api();
+    void set_last_id(const string &id);
+
+    /*!
+     *  @brief  Makes an API call when the rate limit allows it
+     *
+     *          Learns the budget from the response. If the server answers
+     *          with 429 anyway, the call is repeated in the next window.
+     */
+    template <typename T>
+    T rate_limited(api_lease &masto, const RateLimiter::priority prio,
+                   const std::function<T()> &call);
+
+    /*!
+     *  @brief  Returns `true` the first time it is called with `id`
+     */
+    bool first_seen(const string &id);
+
+    bool fetch_missed(string min_id, const notification_handler &handler);
 };
 
 #endif  // EXPANDURL_MASTODON_HPP
@@ -0,0 +1,321 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include "html.hpp"
+
+using std::string;
+
+namespace
+{
+    bool is_space(const char c)
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+    }
+
+    char to_lower(const char c)
+    {
+        return (c >= 'A' && c <= 'Z') ? static_cast<char>(c + ('a' - 'A')) : c;
+    }
+
+    // Case-insensitive comparison of [begin, end) with a lowercase word.
+    bool equals(const char *begin, const char *end, const char *word)
+    {
+        const std::size_t len = std::strlen(word);
+        if (static_cast<std::size_t>(end - begin) != len)
+        {
+            return false;
+        }
+        for (std::size_t i = 0; i < len; ++i)
+        {
+            if (to_lower(begin[i]) != word[i])
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Returns true if [begin, end) contains word, case-sensitive.
+    bool contains(const char *begin, const char *end, const char *word)
+    {
+        const std::size_t len = std::strlen(word);
+        while (static_cast<std::size_t>(end - begin) >= len)
+        {
+            begin = static_cast<const char*>(
+                std::memchr(begin, word[0], end - begin - len + 1));
+            if (begin == nullptr)
+            {
+                return false;
+            }
+            if (std::memcmp(begin, word, len) == 0)
+            {
+                return true;
+            }
+            ++begin;
+        }
+
+        return false;
+    }
+
+    void append_utf8(string &out, const std::uint32_t cp)
+    {
+        if (cp < 0x80)
+        {
+            out += static_cast<char>(cp);
+        }
+        else if (cp < 0x800)
+        {
+            out += static_cast<char>(0xC0 | (cp >> 6));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+        else if (cp < 0x10000)
+        {
+            out += static_cast<char>(0xE0 | (cp >> 12));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+        else
+        {
+            out += static_cast<char>(0xF0 | (cp >> 18));
+            out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+    }
+
+    // Decodes the entity between '&' and ';'. Returns false if unknown.
+    bool decode_entity(const char *begin, const char *end, string &out)
+    {
+        if (begin < end && *begin == '#')
+        {
+            ++begin;
+            std::uint32_t base = 10;
+            if (begin < end && (*begin == 'x' || *begin == 'X'))
+            {
+                base = 16;
+                ++begin;
+            }
+            if (begin == end)
+            {
+                return false;
+            }
+
+            std::uint32_t cp = 0;
+            for (; begin < end; ++begin)
+            {
+                const char c = to_lower(*begin);
+                std::uint32_t digit;
+                if (c >= '0' && c <= '9')
+                {
+                    digit = static_cast<std::uint32_t>(c - '0');
+                }
+                else if (base == 16 && c >= 'a' && c <= 'f')
+                {
+                    digit = static_cast<std::uint32_t>(c - 'a' + 10);
+                }
+                else
+                {
+                    return false;
+                }
+                cp = cp * base + digit;
+            }
+            if (cp == 0 || cp > 0x10FFFF)
+            {
+                return false;
+            }
+            append_utf8(out, cp);
+
+            return true;
+        }
+
+        if (equals(begin, end, "amp"))
+        {
+            out += '&';
+        }
+        else if (equals(begin, end, "lt"))
+        {
+            out += '<';
+        }
+        else if (equals(begin, end, "gt"))
+        {
+            out += '>';
+        }
+        else if (equals(begin, end, "quot"))
+        {
+            out += '"';
+        }
+        else if (equals(begin, end, "apos"))
+        {
+            out += '\'';
+        }
+        else
+        {
+            return false;
+        }
+
+        return true;
+    }
+}
+
+const string decode_entities(const char *begin, const char *end)
+{
+    // Entities are never longer than this, including '&' and ';'.
+    constexpr std::ptrdiff_t max_entity_length = 10;
+    string out;
+    out.reserve(static_cast<std::size_t>(end - begin));
+
+    while (begin < end)
+    {
+        const char *amp = static_cast<const char*>(
+            std::memchr(begin, '&', static_cast<std::size_t>(end - begin)));
+        if (amp == nullptr)
+        {
+            out.append(begin, end);
+            break;
+        }
+        out.append(begin, amp);
+
+        const std::ptrdiff_t window = std::min(end - amp, max_entity_length);
+        const char *semicolon = static_cast<const char*>(
+            std::memchr(amp, ';', static_cast<std::size_t>(window)));
+        if (semicolon == nullptr || !decode_entity(amp + 1, semicolon, out))
+        {
+            out += '&';
+            begin = amp + 1;
+        }
+        else
+        {
+            begin = semicolon + 1;
+        }
+    }
+
+    return out;
+}
+
+const std::vector<string> extract_urls(const string &html)
+{
+    std::vector<string> urls;
+    const char *pos = html.data();
+    const char *const end = pos + html.size();
+
+    while (pos < end)
+    {
+        pos = static_cast<const char*>(
+            std::memchr(pos, '<', static_cast<std::size_t>(end - pos)));
+        if (pos == nullptr)
+        {
+            break;
+        }
+        ++pos;
+        if (end - pos < 2 || to_lower(pos[0]) != 'a' || !is_space(pos[1]))
+        {
+            continue;
+        }
+        ++pos;
+
+        const char *href_begin = nullptr;
+        const char *href_end = nullptr;
+        bool skip = false;
+
+        // Parse attributes until the end of the tag.
+        while (pos < end && *pos != '>')
+        {
+            if (is_space(*pos) || *pos == '/')
+            {
+                ++pos;
+                continue;
+            }
+
+            const char *name_begin = pos;
+            while (pos < end && !is_space(*pos) && *pos != '='
+                   && *pos != '>')
+            {
+                ++pos;
+            }
+            const char *name_end = pos;
+            while (pos < end && is_space(*pos))
+            {
+                ++pos;
+            }
+
+            const char *value_begin = pos;
+            const char *value_end = pos;
+            if (pos < end && *pos == '=')
+            {
+                ++pos;
+                while (pos < end && is_space(*pos))
+                {
+                    ++pos;
+                }
+                // Tolerate quotes escaped with a backslash.
+                if (end - pos >= 2 && *pos == '\\'
+                    && (pos[1] == '"' || pos[1] == '\''))
+                {
+                    ++pos;
+                }
+
+                if (pos < end && (*pos == '"' || *pos == '\''))
+                {
+                    const char quote = *pos;
+                    value_begin = ++pos;
+                    const char *closing = static_cast<const char*>(
+                        std::memchr(pos, quote,
+                                    static_cast<std::size_t>(end - pos)));
+                    value_end = (closing == nullptr ? end : closing);
+                    if (value_end > value_begin && value_end[-1] == '\\')
+                    {
+                        --value_end;
+                    }
+                    pos = (closing == nullptr ? end : closing + 1);
+                }
+                else
+                {
+                    value_begin = pos;
+                    while (pos < end && !is_space(*pos) && *pos != '>')
+                    {
+                        ++pos;
+                    }
+                    value_end = pos;
+                }
+            }
+
+            if (equals(name_begin, name_end, "href"))
+            {
+                href_begin = value_begin;
+                href_end = value_end;
+            }
+            else if (equals(name_begin, name_end, "class"))
+            {
+                if (contains(value_begin, value_end, "mention")
+                    || contains(value_begin, value_end, "hashtag"))
+                {
+                    skip = true;
+                }
+            }
+        }
+
+        if (href_begin != nullptr && href_end > href_begin && !skip)
+        {
+            urls.push_back(decode_entities(href_begin, href_end));
+        }
+    }
+
+    return urls;
+}
@@ -0,0 +1,49 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HTML_HPP
+#define HTML_HPP
+
+#include <string>
+#include <vector>
+
+using std::string;
+
+/*!
+ *  @brief  Extract the targets of all links from HTML
+ *
+ *          Scans the HTML once, without copying it. Links with a class
+ *          containing `mention` or `hashtag` are skipped. HTML entities in
+ *          the URLs are decoded.
+ *
+ *  @param  html    The HTML to scan
+ *
+ *  @return vector of URLs, in the order they appear
+ */
+const std::vector<string> extract_urls(const string &html);
+
+/*!
+ *  @brief  Decodes HTML entities in [`begin`, `end`)
+ *
+ *          Supports the named entities `&amp;`, `&lt;`, `&gt;`, `&quot;` and
+ *          `&apos;` as well as decimal and hexadecimal character references.
+ *          Unknown entities are copied verbatim.
+ *
+ *  @return The decoded string
+ */
+const string decode_entities(const char *begin, const char *end);
+
+#endif  // HTML_HPP
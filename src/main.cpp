@@ -17,20 +17,36 @@
 #include <iostream>
 #include <chrono>
 #include <csignal>
+#include <cstdlib>
+#include <cinttypes>
 #include <regex>
-#include <numeric>
+#include <thread>
+#include <array>
+#include <utility>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <functional>
 #include <syslog.h>
 #include <unistd.h> // getuid()
 #include <curlpp/cURLpp.hpp>
 #include "configjson.hpp"
 #include "expandurl-mastodon.hpp"
+#include "timerwheel.hpp"
+#include "metrics.hpp"
+#include "pipeline.hpp"
+#include "workerpool.hpp"
 
 using namespace Mastodon;
 
 using std::string;
+using std::chrono::steady_clock;
 
-bool running = true;
+std::atomic<bool> running(true);
+std::atomic<bool> reload(false);
 ConfigJSON configfile("expandurl-mastodon.json");
+// Set while the listeners exist.
+std::atomic<std::vector<std::unique_ptr<Listener>>*> listeners_ptr(nullptr);
 
 void signal_handler(int signum)
 {
@@ -47,97 +63,441 @@ void signal_handler(int signum)
             syslog(LOG_NOTICE, "Received signal %d, closing...", signum);
             std::cerr << "Received signal " << signum << ", closing...\n";
             break;
+        case SIGHUP:
+            reload = true;
+            break;
         default:
             break;
     }
+
+    const auto *listeners = listeners_ptr.load();
+    if (listeners != nullptr)
+    {
+        for (const auto &listener : *listeners)
+        {
+            listener->wake();
+        }
+    }
 }
 
-int main()
+// Reads the replacements and unwrap rules from the config file again.
+void reload_config()
 {
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
+    ConfigJSON newconfig("expandurl-mastodon.json");
+
+    syslog(LOG_NOTICE, "Reloading replacements and unwrap rules...");
+    try
+    {
+        if (!newconfig.read())
+        {
+            syslog(LOG_ERR, "Could not open %s.",
+                   newconfig.get_filepath().c_str());
+            return;
+        }
+    }
+    catch (const std::exception &e)
+    {
+        syslog(LOG_ERR, "Could not parse %s: %s",
+               newconfig.get_filepath().c_str(), e.what());
+        return;
+    }
+
+    // The listeners may write the config file at the same time.
+    const Json::Value &replace = newconfig.get_json()["replace"];
+    if (!replace.isNull() && reload_replacements(replace))
+    {
+        std::lock_guard<std::mutex> lock(config_mutex);
+        configfile.get_json()["replace"] = replace;
+    }
+
+    const Json::Value &unwrap = newconfig.get_json()["unwrap"];
+    if (!unwrap.isNull() && reload_unwrap_rules(unwrap))
+    {
+        std::lock_guard<std::mutex> lock(config_mutex);
+        configfile.get_json()["unwrap"] = unwrap;
+    }
+}
 
+// Values that are read when the metrics are written.
+void register_gauges(const std::vector<std::unique_ptr<Listener>> &listeners,
+                     const Pipeline &pipeline)
+{
+    using namespace std::chrono;
+    Metrics &metrics = get_metrics();
+    const std::array<std::pair<Metrics::stage, const char*>, 4> stages =
+    {{
+        { Metrics::stage::parent, "parent" },
+        { Metrics::stage::status, "status" },
+        { Metrics::stage::expand, "expand" },
+        { Metrics::stage::reply, "reply" }
+    }};
+
+    for (const auto &stage : stages)
+    {
+        const Metrics::stage s = stage.first;
+        metrics.add_gauge(string("queue_depth_") + stage.second,
+                          string("Mentions waiting for the ") + stage.second
+                          + " stage.", "gauge",
+                          [&pipeline, s]
+                          { return pipeline.get_queue_size(s); });
+    }
+    for (const auto &ptr : listeners)
+    {
+        const Listener &listener = *ptr;
+        const string labels = "account=\"" + listener.get_account() + '"';
+        metrics.add_gauge("seconds_since_keepalive",
+                          "Time since data arrived on the stream.", "gauge",
+                          [&listener]
+                          {
+                              return duration<double>(
+                                  steady_clock::now()
+                                  - listener.get_last_activity()).count();
+                          }, labels);
+        metrics.add_gauge("ratelimit_budget",
+                          "API calls left in this rate limit window.", "gauge",
+                          [&listener]
+                          {
+                              return listener.get_rate_limiter().get_budget();
+                          }, labels);
+        metrics.add_gauge("ratelimit_queue_depth",
+                          "API calls waiting for the rate limit.", "gauge",
+                          [&listener]
+                          {
+                              return listener.get_rate_limiter()
+                                  .get_queue_depth();
+                          }, labels);
+        metrics.add_gauge("status_cache_hits_total",
+                          "Hits of the status cache.", "counter", [&listener]
+                          {
+                              return listener.get_status_cache().get_hits();
+                          }, labels);
+        metrics.add_gauge("status_cache_misses_total",
+                          "Misses of the status cache.", "counter", [&listener]
+                          {
+                              return listener.get_status_cache().get_misses();
+                          }, labels);
+        metrics.add_gauge("stream_buffer_bytes",
+                          "Bytes used by incomplete lines and queued events.",
+                          "gauge", [&listener]
+                          {
+                              return listener.get_stream_memory_usage();
+                          }, labels);
+        metrics.add_gauge("stream_dropped_events_total",
+                          "Events dropped because a line was too long.",
+                          "counter", [&listener]
+                          {
+                              return listener.get_dropped_events();
+                          }, labels);
+    }
+    metrics.add_gauge("urls_expanded_total",
+                      "URLs that were worth expanding, including those "
+                      "answered from the cache.",
+                      "counter",
+                      [] { return get_classifier().get_expanded(); });
+    metrics.add_gauge("urls_skipped_total",
+                      "URLs that were not worth expanding.", "counter",
+                      [] { return get_classifier().get_skipped(); });
+    metrics.add_gauge("hosts_unavailable",
+                      "Hosts that URLs are not expanded for.", "gauge",
+                      [] { return get_circuit_breaker().get_unavailable(); });
+    metrics.add_gauge("requests_refused_total",
+                      "Requests to unavailable hosts that were not made.",
+                      "counter",
+                      [] { return get_circuit_breaker().get_refused(); });
+    if (get_worker_pool().is_running())
+    {
+        metrics.add_gauge("expander_workers",
+                          "Connected expander worker processes.", "gauge",
+                          [] { return get_worker_pool().get_workers(); });
+        metrics.add_gauge("expander_restarts_total",
+                          "Restarts of expander worker processes.", "counter",
+                          [] { return get_worker_pool().get_restarts(); });
+    }
+}
+
+// Starts the expander worker processes, if configured.
+void start_workers()
+{
+    const Json::Value &config = static_cast<const Json::Value&>
+        (configfile.get_json())["expand"];
+    if (!config.isMember("processes"))
+    {
+        return;
+    }
+
+    string socket_path = config.get("socket", "").asString();
+    if (socket_path.empty())
+    {
+        const char *runtime_dir = std::getenv("XDG_RUNTIME_DIR");
+        socket_path = (runtime_dir != nullptr
+                       ? string(runtime_dir) + "/expandurl-mastodon.sock"
+                       : "/tmp/expandurl-mastodon-"
+                         + std::to_string(getuid()) + ".sock");
+    }
+
+    // Workers get a bit more time than the deadline for every
+    // max_concurrent URLs in a job, only those that hang are killed.
+    const std::chrono::milliseconds timeout(
+        config.get("deadline", 30000).asUInt() + 5000);
+    if (!get_worker_pool().start(socket_path,
+                                 static_cast<std::uint16_t>(
+                                     config["processes"].asUInt()),
+                                 "/proc/self/exe", timeout,
+                                 static_cast<std::uint16_t>(
+                                     config.get("max_concurrent", 8)
+                                     .asUInt())))
+    {
+        syslog(LOG_ERR, "Expanding URLs in this process.");
+    }
+}
+
+// Expands URLs for the main process until it closes the connection.
+int run_expander(const string &socket_path)
+{
     if (!configfile.read())
     {
         syslog(LOG_WARNING, "Could not open %s.",
                configfile.get_filepath().c_str());
     }
-    init_replacements();
 
     curlpp::initialize();
-    openlog("expandurl-mastodon", LOG_CONS | LOG_NDELAY | LOG_PID, LOG_LOCAL1);
-    syslog(LOG_NOTICE, "Program started by user %d", getuid());
+    openlog("expandurl-mastodon-expander", LOG_CONS | LOG_NDELAY | LOG_PID,
+            LOG_LOCAL1);
+    const int ret = run_expander_worker(socket_path, expand_urls);
+    closelog();
+    curlpp::terminate();
 
-    Listener listener;
-    listener.start();
-    std::vector<Easy::Notification> new_messages = listener.catchup();
+    return ret;
+}
+
+// Creates one listener per element of the `accounts` array, or one for the
+// whole config file if there is no such array.
+std::vector<std::unique_ptr<Listener>> make_listeners()
+{
+    std::vector<std::unique_ptr<Listener>> listeners;
+    Json::Value &config = configfile.get_json();
+
+    if (!config.isMember("accounts"))
+    {
+        listeners.push_back(std::make_unique<Listener>(
+            config, configfile.get_filepath() + ".journal"));
+        return listeners;
+    }
+
+    for (Json::Value &account : config["accounts"])
+    {
+        const string name = account.get("account", "").asString();
+        if (name.empty())
+        {
+            syslog(LOG_ERR, "Skipping an entry of accounts without account.");
+            continue;
+        }
+        listeners.push_back(std::make_unique<Listener>(
+            account, configfile.get_filepath() + '.' + name + ".journal"));
+    }
+
+    return listeners;
+}
+
+// Receives the mentions of one account and reconnects if necessary, until
+// the program is closed.
+void run_account(Listener &listener, Pipeline &pipeline,
+                 const std::size_t account, std::thread &catchup_thread)
+{
+    std::vector<Easy::Notification> new_messages;
+
+    // Catch up in the background, so that new mentions don't have to wait.
+    const auto catchup = [&listener, &pipeline, account, &catchup_thread]
+    {
+        if (catchup_thread.joinable())
+        {
+            catchup_thread.join();
+        }
+        // Before any live mention of this connection is pushed.
+        const string since = listener.begin_catchup();
+        catchup_thread = std::thread([&listener, &pipeline, account, since]
+        {
+            listener.catchup(since, [&pipeline, account]
+                             (const Easy::Notification &notif)
+            {
+                return pipeline.push(notif, account);
+            });
+        });
+    };
+    catchup();
+
+    TimerWheel timers(std::chrono::seconds(1), 64);
+    std::atomic<bool> reconnect_due(false);
+    bool reconnecting = false;
+    std::uint8_t reconnects = 0;
+    steady_clock::time_point connected_at = steady_clock::now();
 
     while (running)
     {
-        std::this_thread::sleep_for(std::chrono::seconds(2));
-        if (!listener.stillrunning())
+        for (const Easy::Notification &notif : new_messages)
         {
-            listener.stop();
-            syslog(LOG_DEBUG, "Reestablishing connection...");
-            listener.start();
-            new_messages = listener.catchup();
+            pipeline.push(notif, account);
         }
+        new_messages.clear();
 
-        // Only get new messages if we don't have to catchup
-        if (new_messages.size() == 0)
+        // Sleep until something arrives. If nothing, not even a keep-alive
+        // packet, arrives for 25 seconds, the connection is broken.
+        listener.wait(std::chrono::seconds(25));
+        if (reload.exchange(false))
         {
-            new_messages = listener.get_new_messages();
+            reload_config();
+        }
+        if (!running)
+        {
+            break;
         }
 
-        for (Easy::Notification &notif : new_messages)
+        if (reconnect_due)
+        {
+            reconnect_due = false;
+            reconnecting = false;
+            syslog(LOG_DEBUG, "Reestablishing connection...");
+            listener.start();
+            get_metrics().count_reconnect();
+            connected_at = steady_clock::now();
+            catchup();
+        }
+        else if (reconnecting)
         {
-            syslog(LOG_DEBUG, "new message");
-            const string id = listener.get_parent_id(notif);
-            syslog(LOG_DEBUG, "in_reply_to_id: %s", id.c_str());
-            Easy::Status status;
+            continue;
+        }
+        else if (!listener.stillrunning())
+        {
+            listener.stop();
 
-            if (!id.empty())
+            // Don't hammer the server if it is down. A connection that
+            // lasted a while starts the back-off from the beginning.
+            if (steady_clock::now() - connected_at > std::chrono::minutes(5))
             {
-                status = listener.get_status(id);
-                if (status.valid())
-                {
-                    const std::vector<string> vec = get_urls(status.content());
-                    const string message =
-                        std::accumulate(vec.begin(), vec.end(), string(),
-                                        [](const string &s1, const string s2)
-                                        { return s1 + s2 + " \n"; });
-                    if (!message.empty())
-                    {
-                        if (!listener.send_reply(notif.status(), message))
-                        {
-                            syslog(LOG_ERR, "could not send reply to %s",
-                                   id.c_str());
-                        }
-                    }
-                    else
-                    {
-                        listener.send_reply(notif.status(),
-                            "I couldn't find an URL in the message you "
-                            "replied to. 😞");
-                    }
-                }
-                else
-                {
-                    listener.send_reply(notif.status(),
-                        "I couldn't get the message you replied to. 😞");
-                }
+                reconnects = 0;
             }
-            else
+            const std::chrono::milliseconds delay = listener.stream_failed()
+                ? backoff(reconnects, std::chrono::seconds(120),
+                          std::chrono::minutes(15))
+                : backoff(reconnects, std::chrono::seconds(2),
+                          std::chrono::minutes(2));
+            if (reconnects < UINT8_MAX)
             {
-                listener.send_reply(notif.status(),
-                    "I couldn't find the message you replied to. 😞 \n"
-                    "Maybe the federation is a bit wonky at the moment.");
+                ++reconnects;
             }
+            syslog(LOG_INFO, "Reconnecting %s in %" PRId64 " ms",
+                   listener.get_account().c_str(),
+                   static_cast<std::int64_t>(delay.count()));
+
+            // Signals and mentions that are still processed are not held up.
+            reconnecting = true;
+            timers.schedule(delay, [&listener, &reconnect_due]
+            {
+                reconnect_due = true;
+                listener.wake();
+            });
         }
-        new_messages.clear();
+        else
+        {
+            new_messages = listener.get_new_messages();
+        }
+    }
+
+    timers.stop();
+}
+
+int main(int argc, char *argv[])
+{
+    // Started by the WorkerPool, or by hand to add more workers.
+    if (argc == 3 && string(argv[1]) == "--expander")
+    {
+        return run_expander(argv[2]);
+    }
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGHUP, signal_handler);
+
+    if (!configfile.read())
+    {
+        syslog(LOG_WARNING, "Could not open %s.",
+               configfile.get_filepath().c_str());
     }
+    init_replacements();
+    init_unwrap_rules();
 
-    listener.stop();
+    curlpp::initialize();
+    openlog("expandurl-mastodon", LOG_CONS | LOG_NDELAY | LOG_PID, LOG_LOCAL1);
+    syslog(LOG_NOTICE, "Program started by user %d", getuid());
+
+    std::vector<std::unique_ptr<Listener>> listeners = make_listeners();
+    if (listeners.empty())
+    {
+        syslog(LOG_ERR, "No accounts configured.");
+        return 1;
+    }
+    listeners_ptr = &listeners;
+
+    start_workers();
+
+    // All accounts share the workers, the expansion cache and connections.
+    std::vector<Listener*> accounts;
+    for (const auto &listener : listeners)
+    {
+        listener->start();
+        accounts.push_back(listener.get());
+    }
+    Pipeline pipeline(accounts, static_cast<const Json::Value&>
+                      (configfile.get_json())["workers"]);
+
+    register_gauges(listeners, pipeline);
+    const Json::Value &metrics_config = static_cast<const Json::Value&>
+        (configfile.get_json())["metrics"];
+    get_metrics().start(metrics_config.get("file", "").asString(),
+                        std::chrono::seconds(
+                            metrics_config.get("interval", 15).asUInt()));
+
+    std::vector<std::thread> catchup_threads(listeners.size());
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < listeners.size(); ++i)
+    {
+        threads.emplace_back(run_account, std::ref(*listeners[i]),
+                             std::ref(pipeline), i,
+                             std::ref(catchup_threads[i]));
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    syslog(LOG_NOTICE, "Finishing queued mentions...");
+    pipeline.stop();
+    finish_expansions();
+    get_worker_pool().stop();
+    get_metrics().stop();
+    get_metrics().clear_gauges();
+    for (std::thread &thread : catchup_threads)
+    {
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+    }
+    for (const auto &listener : listeners)
+    {
+        listener->stop();
+    }
+    syslog(LOG_INFO, "Expanded %" PRIu64 " URLs, skipped %" PRIu64 ".",
+           get_classifier().get_expanded(), get_classifier().get_skipped());
+    for (const auto &listener : listeners)
+    {
+        syslog(LOG_INFO, "Status cache of %s: %" PRIu64 " hits, %" PRIu64
+               " misses.", listener->get_account().c_str(),
+               listener->get_status_cache().get_hits(),
+               listener->get_status_cache().get_misses());
+    }
+    listeners_ptr = nullptr;
+    listeners.clear();
     closelog();
     curlpp::terminate();
 
@@ -21,35 +21,91 @@
 #include <sstream>
 #include <syslog.h>
 #include <chrono>
+#include <iterator>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <cinttypes>
 #include "version.hpp"
+#include "urlparts.hpp"
 #include "expandurl-mastodon.hpp"
 
 using std::cout;
 using std::string;
 using std::uint8_t;
 
-Listener::Listener()
-: _instance("")
+namespace
+{
+    // Notifications per catch-up page. Mastodon allows up to 30.
+    constexpr std::uint8_t catchup_page_size = 30;
+
+    // Returns the query parameter `name` of the link with the relation `rel`
+    // in a Link header: <https://…?min_id=123>; rel="prev"
+    const string get_link_param(const string &header, const string &rel,
+                                const string &name)
+    {
+        const size_t pos = header.find("rel=\"" + rel + '"');
+        if (pos == string::npos)
+        {
+            return "";
+        }
+        const size_t start = header.rfind('<', pos);
+        const size_t end = header.find('>', start);
+        if (start == string::npos || end == string::npos || end > pos)
+        {
+            return "";
+        }
+
+        return get_query_param(header.substr(start + 1, end - start - 1),
+                               name);
+    }
+
+    // Read-only, so that missing keys are not inserted.
+    const Json::Value &get_section(const char *name)
+    {
+        const Json::Value &config = configfile.get_json();
+        return config[name];
+    }
+}
+
+std::mutex config_mutex;
+
+Listener::Listener(Json::Value &config, const string &journal)
+: _account("")
+, _instance("")
 , _access_token("")
-, _stream("")
-, _ptr(nullptr)
+, _parser({ "notification", "update" },
+          get_section("stream").get("buffer_size", 1048576).asUInt64(),
+          get_section("stream").get("max_pending", 4194304).asUInt64())
 , _running(false)
+, _cancel(false)
+, _failed(false)
+, _wakeup_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
 , _proxy("")
 , _proxy_user("")
 , _proxy_password("")
-, _config(configfile.get_json())
+, _config(config)
+, _statuses(get_section("status_cache").get("size", 1024).asUInt64())
+, _checkpoint(journal,
+              std::chrono::milliseconds(
+                  get_section("checkpoint").get("interval", 1000).asUInt()),
+              get_section("checkpoint").get("compact_after", 1000).asUInt(),
+              [this](const string &) { return write_config(); })
 {
-    read_config();
-    if (_config["access_token"].isNull())
+    string last_id;
+    {
+        std::lock_guard<std::mutex> lock(config_mutex);
+        read_config();
+        last_id = _config["last_id"].asString();
+    }
+    if (_access_token.empty())
     {
         syslog(LOG_INFO, "Attempting to register application and write config file.");
         if (register_app())
         {
             syslog(LOG_INFO, "Registration successful.");
-            if (!configfile.write())
+            if (!write_config())
             {
-                syslog(LOG_ERR, "Could not write %s.",
-                       configfile.get_filepath().c_str());
                 std::exit(1);
             }
         }
@@ -60,20 +116,89 @@ Listener::Listener()
         }
     }
 
-    _masto = std::make_unique<Easy::API>(_instance, _access_token);
-        _masto->set_useragent(static_cast<const string>("expandurl-mastodon/") +
-                              global::version);
-        set_proxy(*_masto);
+    _masto = make_api();
+
+    // The journal may be ahead of the config file after a crash.
+    set_last_id(_checkpoint.load(last_id));
 }
 
 Listener::~Listener()
 {
+    _checkpoint.stop();
+    if (_thread.joinable())
+    {
+        _cancel = true;
+        _thread.join();
+    }
+    close(_wakeup_fd);
+}
+
+std::unique_ptr<Easy::API> Listener::make_api()
+{
+    auto masto = std::make_unique<Easy::API>(_instance, _access_token);
+    masto->set_useragent(static_cast<const string>("expandurl-mastodon/") +
+                         global::version);
+    set_proxy(*masto);
+
+    return masto;
+}
+
+Listener::api_lease::api_lease(Listener &listener)
+: _listener(listener)
+{
+    std::lock_guard<std::mutex> lock(_listener._api_mutex);
+    if (!_listener._api_pool.empty())
+    {
+        _api = std::move(_listener._api_pool.back());
+        _listener._api_pool.pop_back();
+    }
+    else
+    {
+        _api = _listener.make_api();
+    }
+}
+
+Listener::api_lease::~api_lease()
+{
+    std::lock_guard<std::mutex> lock(_listener._api_mutex);
+    _listener._api_pool.push_back(std::move(_api));
+}
+
+Easy::API *Listener::api_lease::operator->()
+{
+    return _api.get();
+}
+
+template <typename T>
+T Listener::rate_limited(api_lease &masto, const RateLimiter::priority prio,
+                         const std::function<T()> &call)
+{
+    T ret;
+
+    // Calls that hit the rate limit anyway are tried again in the next
+    // window.
+    for (std::uint8_t tries = 0; tries < 3; ++tries)
+    {
+        _limiter.acquire(prio);
+        ret = call();
+        if (ret.http_error_code == 429)
+        {
+            _limiter.exhausted(masto->get_header("X-RateLimit-Reset"));
+            continue;
+        }
+        _limiter.update(masto->get_header("X-RateLimit-Limit"),
+                        masto->get_header("X-RateLimit-Remaining"),
+                        masto->get_header("X-RateLimit-Reset"));
+        break;
+    }
+
+    return ret;
 }
 
 void Listener::read_config()
 {
-    _instance = _config["account"].asString();
-    _instance = _instance.substr(_instance.find('@') + 1);
+    _account = _config["account"].asString();
+    _instance = _account.substr(_account.find('@') + 1);
     _access_token = _config["access_token"].asString();
     _proxy = _config["proxy"]["url"].asString();
     _proxy_user = _config["proxy"]["user"].asString();
@@ -83,30 +208,126 @@ void Listener::read_config()
 void Listener::start()
 {
     _running = true;
-    _masto->get_stream(API::v1::streaming_user, _ptr, _stream);
+    _cancel = false;
+    _thread = std::thread(&Listener::stream, this);
 
     syslog(LOG_NOTICE, "Connecting to %s ...", _instance.c_str());
 }
 
 void Listener::stop()
 {
-    if (!configfile.write())
-    {
-        syslog(LOG_ERR, "Could not write %s.",
-               configfile.get_filepath().c_str());
-    }
+    // Also saves the defaults that were filled in at the start.
+    _checkpoint.flush();
+    write_config();
 
-    if (_ptr)
+    if (_thread.joinable())
     {
-        _ptr->cancel_stream();
+        _cancel = true;
         _thread.join();
-        _ptr.reset();
-        _ptr = nullptr;
-        _stream = "";
+        _parser.reset();
     }
     else
     {
-        syslog(LOG_DEBUG, "_ptr is false.");
+        syslog(LOG_DEBUG, "Stream is not running.");
+    }
+}
+
+void Listener::stream()
+{
+    static const string useragent =
+        static_cast<const string>("expandurl-mastodon/") + global::version;
+    const string url = "https://" + _instance + "/api/v1/streaming/user";
+    const string auth = "Authorization: Bearer " + _access_token;
+    const string proxy_auth = _proxy_user + ':' + _proxy_password;
+    curl_slist *headers = curl_slist_append(nullptr, auth.c_str());
+    CURL *handle = curl_easy_init();
+
+    curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(handle, CURLOPT_USERAGENT, useragent.c_str());
+    curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, 30L);
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, stream_writer);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, this);
+    // The progress function is called at least once a second, even if no
+    // data arrives. We use it to cancel the transfer.
+    curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, stream_progress);
+    curl_easy_setopt(handle, CURLOPT_XFERINFODATA, this);
+    if (!_proxy.empty())
+    {
+        curl_easy_setopt(handle, CURLOPT_PROXY, _proxy.c_str());
+        if (!_proxy_user.empty())
+        {
+            curl_easy_setopt(handle, CURLOPT_PROXYUSERPWD, proxy_auth.c_str());
+        }
+    }
+
+    const CURLcode res = curl_easy_perform(handle);
+    long http_code = 0;
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &http_code);
+    _failed = false;
+    if (http_code >= 400)
+    {
+        syslog(LOG_ERR, "Stream: HTTP error %ld", http_code);
+        _failed = true;
+    }
+    else if (res != CURLE_OK && !_cancel)
+    {
+        syslog(LOG_ERR, "Stream: %s", curl_easy_strerror(res));
+    }
+
+    curl_easy_cleanup(handle);
+    curl_slist_free_all(headers);
+
+    _running = false;
+    wake();
+}
+
+std::size_t Listener::stream_writer(char *data, std::size_t size,
+                                    std::size_t nmemb, void *listener)
+{
+    Listener *self = static_cast<Listener*>(listener);
+    // Blocks if the main thread falls behind.
+    if (self->_parser.feed(data, size * nmemb, self->_cancel) > 0)
+    {
+        self->wake();
+    }
+
+    return size * nmemb;
+}
+
+int Listener::stream_progress(void *listener, curl_off_t, curl_off_t,
+                              curl_off_t, curl_off_t)
+{
+    return static_cast<Listener*>(listener)->_cancel ? 1 : 0;
+}
+
+bool Listener::wait(const std::chrono::milliseconds &timeout)
+{
+    pollfd pfd = { _wakeup_fd, POLLIN, 0 };
+    if (poll(&pfd, 1, static_cast<int>(timeout.count())) > 0)
+    {
+        std::uint64_t value;
+        // Reset the counter.
+        if (read(_wakeup_fd, &value, sizeof(value)) != sizeof(value))
+        {
+            syslog(LOG_DEBUG, "Could not reset wakeup counter.");
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+void Listener::wake() const
+{
+    const std::uint64_t one = 1;
+    // If the counter would overflow, the reader is already woken up.
+    if (write(_wakeup_fd, &one, sizeof(one)) != sizeof(one))
+    {
+        return;
     }
 }
 
@@ -115,90 +336,182 @@ const std::vector<Easy::Notification> Listener::get_new_messages()
     using namespace std::chrono;
 
     std::vector<Easy::Notification> v;
-    static system_clock::time_point lastping = system_clock::now();
 
-    std::lock_guard<std::mutex> lock(_ptr->get_mutex());
-    if (!_stream.empty())
+    for (const sse_event &event : _parser.take_events())
     {
-        for (const Easy::stream_event_type &event : Easy::parse_stream(_stream))
+        // Statuses in the home timeline may be replied to later.
+        if (event.type == "update")
         {
-            if (event.type == Easy::event_type::Notification)
-            {
-                Easy::Notification notif(event.data);
-                if (notif.type() == Easy::notification_type::Mention)
-                {
-                    v.push_back(notif);
-                }
-            }
-            else if (event.type == Easy::event_type::Error)
-            {
-                constexpr uint8_t delay_after_error = 120;
-                syslog(LOG_DEBUG, "Connection lost.");
-                const Json::Value err;
-                syslog(LOG_ERR, "Connection terminated: Error %u",
-                       err["error_code"].asUInt());
-                syslog(LOG_INFO, "Waiting for %u seconds", delay_after_error);
-                std::this_thread::sleep_for(std::chrono::seconds(delay_after_error));
-                _running = false;
-            }
+            _statuses.put(Easy::Status(event.data));
+            continue;
         }
-        _stream.clear();
-        lastping = system_clock::now();
-    }
-    else
-    {
-        // If the last keep-alive packet was received 25 seconds or more ago
-        if (duration_cast<seconds>(system_clock::now() - lastping).count() >= 25)
+
+        Easy::Notification notif(event.data);
+        if (notif.type() == Easy::notification_type::Mention
+            && first_seen(notif.id()))
         {
-            lastping = system_clock::now();
-            syslog(LOG_NOTICE, "Detected broken connection.");
-            _running = false;
+            _statuses.put(notif.status());
+            v.push_back(notif);
         }
     }
 
+    // If the last keep-alive packet was received 25 seconds or more ago
+    if (steady_clock::now() - _parser.get_last_activity() >= seconds(25))
+    {
+        syslog(LOG_NOTICE, "Detected broken connection.");
+        _running = false;
+    }
+
     return v;
 }
 
-const std::vector<Easy::Notification> Listener::catchup()
+const string Listener::begin_catchup()
 {
-    std::vector<Easy::Notification> v;
-    const string last_id = _config["last_id"].asString();
-    if (last_id != "")
+    // Only IDs whose mention and all older mentions were replied to are
+    // journaled. The checkpoint is held like a mention that is being
+    // processed, so that live mentions can not move last_id past mentions
+    // that catchup() has not found yet. Mentions that were replied to after
+    // the last sync are replied to again after a crash, first_seen() only
+    // knows the IDs since the start.
+    const string since = _checkpoint.get_durable();
+    if (!since.empty())
+    {
+        mention_started(since);
+    }
+
+    return since;
+}
+
+bool Listener::catchup(const string &since,
+                       const notification_handler &handler)
+{
+    if (since.empty())
+    {
+        return true;
+    }
+
+    bool complete = true;
+    const bool ok = fetch_missed(since,
+                                 [&handler, &complete]
+                                 (const Easy::Notification &notif)
     {
-        syslog(LOG_DEBUG, "Catching up...");
-        parameters parameter =
+        complete = handler(notif);
+        return complete;
+    });
+
+    // The mentions that were found are being processed now and hold last_id
+    // themselves. If some were not found, last_id stays where it is until
+    // the next catchup() gets them. last_id could not move, so
+    // begin_catchup() returns the same ID then.
+    if (ok && complete)
+    {
+        mention_done(since);
+    }
+
+    return ok;
+}
+
+bool Listener::fetch_missed(string min_id, const notification_handler &handler)
+{
+    syslog(LOG_DEBUG, "Catching up...");
+    api_lease masto(*this);
+    std::uint32_t pages = 0;
+
+    // min_id returns the page directly after min_id, so we can walk from the
+    // oldest to the newest notification and hand out each page as it arrives.
+    while (true)
+    {
+        const parameters params =
         {
-            { "since_id", { last_id } },
+            { "min_id", { min_id } },
+            { "limit", { std::to_string(catchup_page_size) } },
             { "exclude_types", { "follow", "favourite", "reblog" } }
         };
-        return_call ret;;
+        const return_call ret = rate_limited<return_call>(
+            masto, RateLimiter::priority::low,
+            [&] { return masto->get(API::v1::notifications, params); });
+        if (!ret)
+        {
+            syslog(LOG_ERR, "Could not catch up: Error %u", ret.error_code);
+            return false;
+        }
 
-        ret = _masto->get(API::v1::notifications, parameter);
+        const std::vector<string> page = Easy::json_array_to_vector(ret.answer);
+        if (page.empty())
+        {
+            break;
+        }
+        ++pages;
 
-        if (ret)
+        // The newest notification comes first.
+        for (auto it = page.rbegin(); it != page.rend(); ++it)
         {
-            for (const string str : Easy::json_array_to_vector(ret.answer))
+            const Easy::Notification notif(*it);
+            if (notif.type() == Easy::notification_type::Mention
+                && first_seen(notif.id()))
             {
-                v.push_back(Easy::Notification(str));
+                _statuses.put(notif.status());
+                if (!handler(notif))
+                {
+                    return true;
+                }
             }
         }
-        else
+
+        string next = get_link_param(masto->get_header("Link"),
+                                     "prev", "min_id");
+        if (next.empty())
         {
-            syslog(LOG_ERR, "Could not catch up: Error %u", ret.error_code);
+            next = Easy::Notification(page.front()).id();
         }
+        if (next.empty() || next == min_id)
+        {
+            break;
+        }
+        min_id = next;
     }
+    syslog(LOG_DEBUG, "Caught up, %" PRIu32 " pages.", pages);
 
-    return v;
+    return true;
+}
+
+bool Listener::first_seen(const string &id)
+{
+    std::lock_guard<std::mutex> lock(_seen_mutex);
+    if (!_seen.insert(id).second)
+    {
+        return false;
+    }
+    _seen_order.push_back(id);
+    if (_seen_order.size() > max_seen)
+    {
+        _seen.erase(_seen_order.front());
+        _seen_order.pop_front();
+    }
+
+    return true;
 }
 
 Mastodon::Easy::Status Listener::get_status(const string &id)
 {
+    Easy::Status status;
+    if (_statuses.get(id, status))
+    {
+        return status;
+    }
+
+    api_lease masto(*this);
     return_call ret;
 
-    ret = _masto->get(API::v1::statuses_id, {{ "id", { id }}});
+    ret = rate_limited<return_call>(masto, RateLimiter::priority::low, [&]
+    {
+        return masto->get(API::v1::statuses_id, {{ "id", { id }}});
+    });
     if (ret)
     {
-        return Easy::Status(ret.answer);
+        status = Easy::Status(ret.answer);
+        _statuses.put(status);
+        return status;
     }
     else
     {
@@ -226,7 +539,11 @@ bool Listener::send_reply(const Easy::Status &to_status,
     new_status.sensitive(to_status.sensitive());
     new_status.spoiler_text(to_status.spoiler_text());
 
-    ret = _masto->send_post(new_status);
+    // Replies go before lookups.
+    api_lease masto(*this);
+    ret = rate_limited<Easy::return_entity<Easy::Status>>(
+        masto, RateLimiter::priority::high,
+        [&] { return masto->send_post(new_status); });
 
     if (ret)
     {
@@ -240,50 +557,129 @@ bool Listener::send_reply(const Easy::Status &to_status,
     }
 }
 
-const string Listener::get_parent_id(const Easy::Notification &notif)
+const string Listener::get_parent_id(const Easy::Notification &notif,
+                                     bool &retry)
 {
-    return_call ret;
+    retry = false;
 
-    // Retry up to 2 times
-    for (std::uint_fast8_t retries = 1; retries <= 2; ++retries)
+    // The notification usually contains everything we need.
+    const Easy::Status mention = notif.status();
+    if (!mention.in_reply_to_id().empty())
     {
-        // Fetch full status
-        ret = _masto->get(API::v1::search, {{ "q", { notif.status().url() }}});
-        if (!ret)
+        return mention.in_reply_to_id();
+    }
+
+    // Local statuses are complete, this is not a reply.
+    if (mention.account().acct().find('@') == string::npos)
+    {
+        return "";
+    }
+
+    // Statuses from other instances are only complete after the server
+    // fetched them, search makes it do that.
+    api_lease masto(*this);
+    return_call ret = rate_limited<return_call>(
+        masto, RateLimiter::priority::low, [&]
         {
-            syslog(LOG_ERR, "Error %u: Could not fetch status (in %s).",
-                   ret.error_code, __FUNCTION__);
-            return 0;
-        }
+            return masto->get(API::v1::search, {{ "q", { mention.url() }}});
+        });
+    if (!ret)
+    {
+        syslog(LOG_ERR, "Error %u: Could not fetch status (in %s).",
+               ret.error_code, __FUNCTION__);
+        return "";
+    }
+
+    ret = rate_limited<return_call>(masto, RateLimiter::priority::low, [&]
+    {
+        return masto->get(API::v1::statuses_id, {{ "id", { mention.id() }}});
+    });
+    if (!ret)
+    {
+        syslog(LOG_ERR, "Error %u: Could not get status (in %s).",
+               ret.error_code, __FUNCTION__);
+        return "";
+    }
 
-        ret = _masto->get(API::v1::statuses_id,
-                          {{ "id", { notif.status().id() }}});
+    const Easy::Status s(ret.answer);
+    _statuses.put(s);
 
-        if (!ret)
+    // The parent may not have federated yet.
+    if (s.in_reply_to_id().empty())
+    {
+        syslog(LOG_WARNING, "Could not get ID of replied-to post");
+        retry = true;
+    }
+
+    return s.in_reply_to_id();
+}
+
+bool Listener::id_order::operator()(const string &a, const string &b) const
+{
+    return a.length() < b.length() || (a.length() == b.length() && a < b);
+}
+
+void Listener::mention_started(const string &id)
+{
+    std::lock_guard<std::mutex> lock(_in_flight_mutex);
+    _in_flight.insert(id);
+}
+
+void Listener::mention_done(const string &id)
+{
+    string last_id;
+    {
+        std::lock_guard<std::mutex> lock(_in_flight_mutex);
+        if (_in_flight.erase(id) == 0)
         {
-            syslog(LOG_ERR, "Error %u: Could not get status (in %s).",
-                   ret.error_code, __FUNCTION__);
-            return 0;
+            return;
         }
-        else
+        _done.insert(id);
+
+        // Everything before the oldest unfinished mention is processed.
+        const auto end = (_in_flight.empty()
+                          ? _done.end()
+                          : _done.lower_bound(*_in_flight.begin()));
+        if (end == _done.begin())
         {
-            _config["last_id"] = notif.id();
-            const Easy::Status s(ret.answer);
+            return;
+        }
+        last_id = *std::prev(end);
+        _done.erase(_done.begin(), end);
+    }
 
-            // If parent is found, return ID; else retry
-            if (!s.in_reply_to_id().empty())
-            {
-                return s.in_reply_to_id();
-            }
-            else
-            {
-                syslog(LOG_WARNING, "Could not get ID of replied-to post");
-                std::this_thread::sleep_for(std::chrono::seconds(2));
-            }
+    set_last_id(last_id);
+}
+
+void Listener::set_last_id(const string &id)
+{
+    {
+        std::lock_guard<std::mutex> lock(config_mutex);
+        const string last_id = _config["last_id"].asString();
+
+        // A mention that arrived late may be older, never go back.
+        if (id_order()(id, last_id) || id == last_id)
+        {
+            return;
         }
+        _config["last_id"] = id;
+    }
+
+    // Not under config_mutex, the compaction needs it.
+    _checkpoint.record(id);
+}
+
+bool Listener::write_config()
+{
+    std::lock_guard<std::mutex> lock(config_mutex);
+    if (!configfile.write())
+    {
+        syslog(LOG_ERR, "Could not write %s.",
+               configfile.get_filepath().c_str());
+        return false;
     }
 
-    return 0;
+    return true;
 }
 
 bool Listener::stillrunning() const
@@ -291,12 +687,56 @@ bool Listener::stillrunning() const
     return _running;
 }
 
+const string Listener::get_account() const
+{
+    return _account;
+}
+
+bool Listener::stream_failed() const
+{
+    return _failed;
+}
+
+const StatusCache &Listener::get_status_cache() const
+{
+    return _statuses;
+}
+
+const RateLimiter &Listener::get_rate_limiter() const
+{
+    return _limiter;
+}
+
+std::chrono::steady_clock::time_point Listener::get_last_activity() const
+{
+    return _parser.get_last_activity();
+}
+
+std::size_t Listener::get_stream_memory_usage() const
+{
+    return _parser.get_memory_usage();
+}
+
+std::uint64_t Listener::get_dropped_events() const
+{
+    return _parser.get_dropped();
+}
+
 bool Listener::register_app()
 {
-    cout << "Account (username@instance): ";
-    std::cin >> _instance;
-    _config["account"] = _instance;
-    _instance = _instance.substr(_instance.find('@') + 1);
+    // Accounts from the `accounts` array are already known.
+    if (_account.empty())
+    {
+        cout << "Account (username@instance): ";
+        std::cin >> _account;
+        std::lock_guard<std::mutex> lock(config_mutex);
+        _config["account"] = _account;
+        _instance = _account.substr(_account.find('@') + 1);
+    }
+    else
+    {
+        cout << "Registering " << _account << ".\n";
+    }
 
     _masto = std::make_unique<Easy::API>(_instance, "");
     _masto->set_useragent(static_cast<const string>("expandurl-mastodon/") +
@@ -324,6 +764,7 @@ bool Listener::register_app()
                                     _access_token);
         if (ret)
         {
+            std::lock_guard<std::mutex> lock(config_mutex);
             _config["access_token"] = _access_token;
             return true;
         }
@@ -0,0 +1,403 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdio>
+#include <syslog.h>
+#include "metrics.hpp"
+
+using std::string;
+using std::chrono::microseconds;
+
+namespace
+{
+    const std::array<const char*, 5> stage_names =
+    {{
+        "parent", "status", "expand", "reply", "mention"
+    }};
+
+    std::uint64_t fnv1a(const string &str)
+    {
+        std::uint64_t hash = 14695981039346656037ULL;
+        for (const char c : str)
+        {
+            hash ^= static_cast<unsigned char>(c);
+            hash *= 1099511628211ULL;
+        }
+
+        return hash;
+    }
+
+    // Label values must not contain quotes, backslashes or newlines.
+    const string escape_label(const string &value)
+    {
+        string escaped;
+        for (const char c : value)
+        {
+            if (c == '"' || c == '\\')
+            {
+                escaped += '\\';
+            }
+            if (c != '\n')
+            {
+                escaped += c;
+            }
+        }
+
+        return escaped;
+    }
+}
+
+Histogram::Histogram()
+: _sum(0)
+{
+    for (std::atomic<std::uint64_t> &count : _counts)
+    {
+        count = 0;
+    }
+}
+
+void Histogram::record(const microseconds &duration)
+{
+    const std::uint64_t value =
+        duration.count() > 0 ? static_cast<std::uint64_t>(duration.count()) : 0;
+    std::size_t index = 0;
+
+    // [1000 << e, 1500 << e) and [1500 << e, 2000 << e) are the 2 buckets of
+    // the power e.
+    const std::uint64_t ms = value / 1000;
+    if (ms > 0)
+    {
+        const std::size_t e =
+            static_cast<std::size_t>(63 - __builtin_clzll(ms));
+        const std::uint64_t base = 1000ULL << e;
+        index = 1 + 2 * e + (value >= base + base / 2 ? 1 : 0);
+        if (index > buckets - 1)
+        {
+            index = buckets - 1;
+        }
+    }
+
+    _counts[index].fetch_add(1, std::memory_order_relaxed);
+    _sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+std::uint64_t Histogram::upper_bound(const std::size_t index)
+{
+    if (index == 0)
+    {
+        return 1000;
+    }
+    const std::size_t e = (index - 1) / 2;
+
+    return (index % 2 == 1) ? (1500ULL << e) : (2000ULL << e);
+}
+
+void Histogram::write(std::ostream &out, const string &name,
+                      const string &labels) const
+{
+    const string sep = labels.empty() ? "" : ",";
+    std::uint64_t cumulative = 0;
+
+    for (std::size_t i = 0; i < buckets; ++i)
+    {
+        cumulative += _counts[i].load(std::memory_order_relaxed);
+        out << name << "_bucket{" << labels << sep << "le=\"";
+        if (i == buckets - 1)
+        {
+            out << "+Inf";
+        }
+        else
+        {
+            out << static_cast<double>(upper_bound(i)) / 1000000;
+        }
+        out << "\"} " << cumulative << '\n';
+    }
+    const string braces = labels.empty() ? "" : '{' + labels + '}';
+    out << name << "_sum" << braces << ' '
+        << static_cast<double>(_sum.load(std::memory_order_relaxed)) / 1000000
+        << '\n';
+    out << name << "_count" << braces << ' ' << cumulative << '\n';
+}
+
+Metrics::Metrics()
+: _other_errors(0)
+, _cache_hits(0)
+, _reconnects(0)
+, _deadlines_met(0)
+, _deadlines_missed(0)
+, _running(false)
+{
+    for (host_metrics &host : _hosts)
+    {
+        host.hash = 0;
+        host.ready = false;
+        host.errors = 0;
+    }
+}
+
+Metrics::~Metrics()
+{
+    stop();
+}
+
+void Metrics::record_stage(const stage s, const microseconds &duration)
+{
+    _stages[static_cast<std::size_t>(s)].record(duration);
+}
+
+void Metrics::record_expansion(const string &host,
+                               const microseconds &duration, const bool ok)
+{
+    host_metrics *metrics = get_host(host);
+    if (metrics != nullptr)
+    {
+        metrics->latency.record(duration);
+        if (!ok)
+        {
+            metrics->errors.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    else
+    {
+        _other_latency.record(duration);
+        if (!ok)
+        {
+            _other_errors.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+void Metrics::count_deadline(const bool met)
+{
+    (met ? _deadlines_met : _deadlines_missed)
+        .fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::count_cache_hit()
+{
+    _cache_hits.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::count_reconnect()
+{
+    _reconnects.fetch_add(1, std::memory_order_relaxed);
+}
+
+Metrics::host_metrics *Metrics::get_host(const string &host)
+{
+    // 0 marks a free slot.
+    const std::uint64_t hash = fnv1a(host) | 1;
+
+    // Open addressing. A slot is claimed with compare-and-swap, the name is
+    // written afterwards and published with `ready`.
+    for (std::size_t i = 0; i < max_hosts; ++i)
+    {
+        host_metrics &slot = _hosts[(hash + i) % max_hosts];
+        std::uint64_t current = slot.hash.load(std::memory_order_acquire);
+        if (current == hash)
+        {
+            return &slot;
+        }
+        if (current == 0
+            && slot.hash.compare_exchange_strong(current, hash,
+                                                 std::memory_order_acq_rel))
+        {
+            std::strncpy(slot.name, host.c_str(), sizeof(slot.name) - 1);
+            slot.name[sizeof(slot.name) - 1] = '\0';
+            slot.ready.store(true, std::memory_order_release);
+            return &slot;
+        }
+        // Another thread was faster, maybe with the same host.
+        if (current == hash)
+        {
+            return &slot;
+        }
+    }
+
+    return nullptr;
+}
+
+void Metrics::add_gauge(const string &name, const string &help,
+                        const string &type,
+                        const std::function<double()> &value,
+                        const string &labels)
+{
+    std::lock_guard<std::mutex> lock(_gauges_mutex);
+    _gauges.push_back({ "expandurl_" + name, help, type, value, labels });
+}
+
+void Metrics::clear_gauges()
+{
+    std::lock_guard<std::mutex> lock(_gauges_mutex);
+    _gauges.clear();
+}
+
+void Metrics::write(std::ostream &out) const
+{
+    out.precision(12);
+    out << "# HELP expandurl_stage_seconds Time spent in each stage of "
+           "processing a mention.\n"
+        << "# TYPE expandurl_stage_seconds histogram\n";
+    for (std::size_t i = 0; i < stages; ++i)
+    {
+        _stages[i].write(out, "expandurl_stage_seconds",
+                         string("stage=\"") + stage_names[i] + '"');
+    }
+
+    out << "# HELP expandurl_expansion_seconds Time to expand an URL that "
+           "was not in the cache, by host.\n"
+        << "# TYPE expandurl_expansion_seconds histogram\n";
+    for (const host_metrics &host : _hosts)
+    {
+        if (host.ready.load(std::memory_order_acquire))
+        {
+            host.latency.write(out, "expandurl_expansion_seconds",
+                               "host=\"" + escape_label(host.name) + '"');
+        }
+    }
+    _other_latency.write(out, "expandurl_expansion_seconds",
+                         "host=\"other\"");
+
+    out << "# HELP expandurl_expansion_errors_total URLs that could not be "
+           "expanded, by host.\n"
+        << "# TYPE expandurl_expansion_errors_total counter\n";
+    for (const host_metrics &host : _hosts)
+    {
+        if (host.ready.load(std::memory_order_acquire))
+        {
+            out << "expandurl_expansion_errors_total{host=\""
+                << escape_label(host.name) << "\"} "
+                << host.errors.load(std::memory_order_relaxed) << '\n';
+        }
+    }
+    out << "expandurl_expansion_errors_total{host=\"other\"} "
+        << _other_errors.load(std::memory_order_relaxed) << '\n';
+
+    out << "# HELP expandurl_cache_hits_total URLs that were answered from "
+           "the cache instead of being expanded.\n"
+        << "# TYPE expandurl_cache_hits_total counter\n"
+        << "expandurl_cache_hits_total "
+        << _cache_hits.load(std::memory_order_relaxed) << '\n';
+
+    out << "# HELP expandurl_stream_reconnects_total Reconnects of the "
+           "stream.\n"
+        << "# TYPE expandurl_stream_reconnects_total counter\n"
+        << "expandurl_stream_reconnects_total "
+        << _reconnects.load(std::memory_order_relaxed) << '\n';
+
+    out << "# HELP expandurl_deadlines_total Mentions whose URLs were all "
+           "expanded before the deadline, or not.\n"
+        << "# TYPE expandurl_deadlines_total counter\n"
+        << "expandurl_deadlines_total{result=\"met\"} "
+        << _deadlines_met.load(std::memory_order_relaxed) << '\n'
+        << "expandurl_deadlines_total{result=\"missed\"} "
+        << _deadlines_missed.load(std::memory_order_relaxed) << '\n';
+
+    std::lock_guard<std::mutex> lock(_gauges_mutex);
+    for (auto it = _gauges.begin(); it != _gauges.end(); ++it)
+    {
+        // All samples of a metric have to follow its HELP and TYPE lines.
+        if (std::any_of(_gauges.begin(), it, [&it](const gauge &g)
+                        { return g.name == it->name; }))
+        {
+            continue;
+        }
+        out << "# HELP " << it->name << ' ' << it->help << '\n'
+            << "# TYPE " << it->name << ' ' << it->type << '\n';
+        for (auto g = it; g != _gauges.end(); ++g)
+        {
+            if (g->name != it->name)
+            {
+                continue;
+            }
+            out << g->name;
+            if (!g->labels.empty())
+            {
+                out << '{' << g->labels << '}';
+            }
+            out << ' ' << g->value() << '\n';
+        }
+    }
+}
+
+bool Metrics::write_file(const string &path) const
+{
+    // Write to a temporary file and rename it, so that readers never see a
+    // half-written file.
+    const string tmp = path + ".tmp";
+    {
+        std::ofstream file(tmp);
+        if (!file.is_open())
+        {
+            return false;
+        }
+        write(file);
+        if (!file.good())
+        {
+            return false;
+        }
+    }
+
+    return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+void Metrics::start(const string &path, const std::chrono::seconds &interval)
+{
+    std::lock_guard<std::mutex> lock(_thread_mutex);
+    if (_running || path.empty())
+    {
+        return;
+    }
+    _running = true;
+    _thread = std::thread([this, path, interval]
+    {
+        std::unique_lock<std::mutex> lock(_thread_mutex);
+        while (_running)
+        {
+            lock.unlock();
+            if (!write_file(path))
+            {
+                syslog(LOG_ERR, "Could not write %s.", path.c_str());
+            }
+            lock.lock();
+            _cv.wait_for(lock, interval, [this] { return !_running; });
+        }
+    });
+}
+
+void Metrics::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(_thread_mutex);
+        _running = false;
+    }
+    _cv.notify_all();
+    if (_thread.joinable())
+    {
+        _thread.join();
+    }
+}
+
+Metrics &get_metrics()
+{
+    static Metrics metrics;
+
+    return metrics;
+}
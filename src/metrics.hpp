@@ -0,0 +1,233 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <string>
+#include <vector>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <ostream>
+#include <chrono>
+#include <cstdint>
+
+using std::string;
+
+/*!
+ *  @brief  Latency histogram with logarithmic buckets
+ *
+ *          Like HDR histograms, the buckets get wider with the value: there
+ *          are 2 buckets per power of 2, from 1 ms to about 2 minutes. The
+ *          relative error is at most 50 %, the cost of record() is a few bit
+ *          operations and two atomic additions.
+ *
+ *          Lock-free.
+ */
+class Histogram
+{
+public:
+    //! Number of buckets, the last one is for everything above 2^17 ms
+    static constexpr std::size_t buckets = 36;
+
+    Histogram();
+
+    /*!
+     *  @brief  Adds a measurement
+     */
+    void record(const std::chrono::microseconds &duration);
+
+    /*!
+     *  @brief  Writes the histogram in Prometheus text format
+     *
+     *  @param  out     Stream to write to
+     *  @param  name    Name of the metric, without `_bucket` etc.
+     *  @param  labels  Labels, like `stage="reply"`, or an empty string
+     */
+    void write(std::ostream &out, const string &name,
+               const string &labels) const;
+
+private:
+    std::array<std::atomic<std::uint64_t>, buckets> _counts;
+    std::atomic<std::uint64_t> _sum;
+
+    // Upper bound of bucket `index` in microseconds.
+    static std::uint64_t upper_bound(const std::size_t index);
+};
+
+/*!
+ *  @brief  Collects metrics and writes them in Prometheus text format
+ *
+ *          Recording is lock-free. Gauges are functions that are called when
+ *          the metrics are written. If a file is given to start(), it is
+ *          rewritten periodically, for the textfile collector of the node
+ *          exporter, for example.
+ *
+ *          Example:
+ *  @code
+ *          Metrics &metrics = get_metrics();
+ *          metrics.record_stage(Metrics::stage::reply, duration);
+ *          metrics.add_gauge("queue_depth", "Mentions waiting", "gauge",
+ *                            [&] { return queue.size(); });
+ *          metrics.start("/var/lib/expandurl-mastodon/metrics.prom",
+ *                        std::chrono::seconds(15));
+ *  @endcode
+ */
+class Metrics
+{
+public:
+    //! Stages of processing a mention
+    enum class stage
+    {
+        parent,
+        status,
+        expand,
+        reply,
+        //! From receiving the mention to sending the reply
+        mention
+    };
+
+    Metrics();
+    ~Metrics();
+
+    Metrics(const Metrics &) = delete;
+    Metrics &operator=(const Metrics &) = delete;
+
+    /*!
+     *  @brief  Records how long a stage took for one mention
+     */
+    void record_stage(const stage s, const std::chrono::microseconds &duration);
+
+    /*!
+     *  @brief  Records the expansion of an URL of `host`
+     */
+    void record_expansion(const string &host,
+                          const std::chrono::microseconds &duration,
+                          const bool ok);
+
+    /*!
+     *  @brief  Counts a mention whose URLs were, or were not, all expanded
+     *          before its deadline
+     */
+    void count_deadline(const bool met);
+
+    /*!
+     *  @brief  Counts an URL that was answered from the cache instead of
+     *          being expanded
+     */
+    void count_cache_hit();
+
+    /*!
+     *  @brief  Counts a reconnect of the stream
+     */
+    void count_reconnect();
+
+    /*!
+     *  @brief  Adds a value that is read when the metrics are written
+     *
+     *  @param  name    Name, `expandurl_` is prepended
+     *  @param  help    Description
+     *  @param  type    `gauge` or `counter`
+     *  @param  value   Returns the current value, must be thread-safe
+     *  @param  labels  Labels like `account="bot@example.social"`. Gauges
+     *                  with the same name and different labels are written
+     *                  together.
+     */
+    void add_gauge(const string &name, const string &help, const string &type,
+                   const std::function<double()> &value,
+                   const string &labels = "");
+
+    /*!
+     *  @brief  Removes all gauges, before the objects they read are gone
+     */
+    void clear_gauges();
+
+    /*!
+     *  @brief  Writes all metrics in Prometheus text format
+     */
+    void write(std::ostream &out) const;
+
+    /*!
+     *  @brief  Replaces `path` with the current metrics
+     *
+     *  @return `false` if the file could not be written
+     */
+    bool write_file(const string &path) const;
+
+    /*!
+     *  @brief  Writes the metrics to `path` every `interval`
+     */
+    void start(const string &path, const std::chrono::seconds &interval);
+
+    /*!
+     *  @brief  Stops writing the metrics
+     */
+    void stop();
+
+private:
+    // Expansion metrics for one host, claimed on first use.
+    struct host_metrics
+    {
+        std::atomic<std::uint64_t> hash;
+        std::atomic<bool> ready;
+        char name[64];
+        Histogram latency;
+        std::atomic<std::uint64_t> errors;
+    };
+
+    struct gauge
+    {
+        string name;
+        string help;
+        string type;
+        std::function<double()> value;
+        string labels;
+    };
+
+    static constexpr std::size_t max_hosts = 128;
+    static constexpr std::size_t stages = 5;
+
+    std::array<Histogram, stages> _stages;
+    std::array<host_metrics, max_hosts> _hosts;
+    // For hosts that don't fit into _hosts.
+    Histogram _other_latency;
+    std::atomic<std::uint64_t> _other_errors;
+    std::atomic<std::uint64_t> _cache_hits;
+    std::atomic<std::uint64_t> _reconnects;
+    std::atomic<std::uint64_t> _deadlines_met;
+    std::atomic<std::uint64_t> _deadlines_missed;
+
+    std::vector<gauge> _gauges;
+    mutable std::mutex _gauges_mutex;
+
+    std::thread _thread;
+    std::mutex _thread_mutex;
+    std::condition_variable _cv;
+    bool _running;
+
+    host_metrics *get_host(const string &host);
+};
+
+/*!
+ *  @brief  Returns the metrics of the process
+ */
+Metrics &get_metrics();
+
+#endif  // METRICS_HPP
@@ -0,0 +1,358 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <numeric>
+#include <functional>
+#include <syslog.h>
+#include "pipeline.hpp"
+
+using std::string;
+
+namespace
+{
+    template <typename T>
+    void start_workers(std::vector<std::thread> &workers,
+                       const Json::Value::UInt number, Queue<T> &queue,
+                       const std::function<void(T&)> &handler)
+    {
+        for (Json::Value::UInt i = 0; i < (number > 0 ? number : 1); ++i)
+        {
+            workers.emplace_back([&queue, handler]
+            {
+                T item;
+                while (queue.pop(item))
+                {
+                    handler(item);
+                }
+            });
+        }
+    }
+
+    // The replied-to post may need some time to federate.
+    constexpr std::uint8_t max_parent_retries = 3;
+    constexpr std::uint8_t max_reply_retries = 3;
+
+    // Measures the time until it goes out of scope.
+    class stage_timer
+    {
+    public:
+        explicit stage_timer(const Metrics::stage s)
+        : _stage(s)
+        , _start(std::chrono::steady_clock::now())
+        {}
+
+        ~stage_timer()
+        {
+            using namespace std::chrono;
+            get_metrics().record_stage(_stage, duration_cast<microseconds>(
+                                           steady_clock::now() - _start));
+        }
+
+    private:
+        const Metrics::stage _stage;
+        const std::chrono::steady_clock::time_point _start;
+    };
+
+    void join_workers(std::vector<std::thread> &workers)
+    {
+        for (std::thread &worker : workers)
+        {
+            worker.join();
+        }
+        workers.clear();
+    }
+}
+
+Pipeline::Pipeline(const std::vector<Listener*> &listeners,
+                   const Json::Value &config)
+: _listeners(listeners)
+, _reply_deadline(config.get("reply_deadline", 5000).asUInt())
+, _parent_queue(config.get("queue_size", 64).asUInt(), listeners.size())
+, _status_queue(config.get("queue_size", 64).asUInt(), listeners.size())
+, _expand_queue(config.get("queue_size", 64).asUInt(), listeners.size())
+, _reply_queue(config.get("queue_size", 64).asUInt(), listeners.size())
+, _stopped(false)
+{
+    using namespace std::placeholders;
+
+    start_workers<job>(_parent_workers, config.get("parent", 2).asUInt(),
+                       _parent_queue,
+                       std::bind(&Pipeline::resolve_parent, this, _1));
+    start_workers<job>(_status_workers, config.get("status", 2).asUInt(),
+                       _status_queue,
+                       std::bind(&Pipeline::fetch_status, this, _1));
+    start_workers<job>(_expand_workers, config.get("expand", 4).asUInt(),
+                       _expand_queue,
+                       std::bind(&Pipeline::expand_urls, this, _1));
+    start_workers<job>(_reply_workers, config.get("reply", 2).asUInt(),
+                       _reply_queue,
+                       std::bind(&Pipeline::reply, this, _1));
+}
+
+Pipeline::~Pipeline()
+{
+    stop();
+}
+
+bool Pipeline::push(const Easy::Notification &notif,
+                    const std::size_t account)
+{
+    if (account >= _listeners.size())
+    {
+        return false;
+    }
+
+    job j;
+    j.notif = notif;
+    j.account = account;
+    j.received = std::chrono::steady_clock::now();
+    j.deadline = (_reply_deadline.count() > 0
+                  ? j.received + _reply_deadline
+                  : std::chrono::steady_clock::time_point::max());
+    j.key = notif.status().in_reply_to_id();
+    if (j.key.empty())
+    {
+        j.key = notif.status().id();
+    }
+    j.key = std::to_string(account) + ':' + j.key;
+
+    {
+        std::lock_guard<std::mutex> lock(_sequences_mutex);
+        if (_stopped)
+        {
+            return false;
+        }
+        j.seq = _sequences[j.key].next_ticket++;
+    }
+
+    _listeners[account]->mention_started(notif.id());
+    return enqueue(_parent_queue, j);
+}
+
+void Pipeline::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(_sequences_mutex);
+        if (_stopped)
+        {
+            return;
+        }
+        _stopped = true;
+    }
+
+    // Retry waiting mentions now, then close the stages one after another,
+    // so that every job is finished.
+    _timers.stop();
+    _parent_queue.close();
+    join_workers(_parent_workers);
+    _status_queue.close();
+    join_workers(_status_workers);
+    _expand_queue.close();
+    join_workers(_expand_workers);
+    _reply_queue.close();
+    join_workers(_reply_workers);
+}
+
+bool Pipeline::enqueue(Queue<job> &queue, job &j)
+{
+    const std::size_t lane = j.account;
+    return queue.push(std::move(j), lane);
+}
+
+const string Pipeline::flight_key(const job &j) const
+{
+    return std::to_string(j.account) + ':' + j.parent_id;
+}
+
+void Pipeline::resolve_parent(job &j)
+{
+    syslog(LOG_DEBUG, "new message");
+    bool retry = false;
+    {
+        stage_timer timer(Metrics::stage::parent);
+        j.parent_id = _listeners[j.account]->get_parent_id(j.notif, retry);
+    }
+    syslog(LOG_DEBUG, "in_reply_to_id: %s", j.parent_id.c_str());
+
+    if (retry && j.attempts < max_parent_retries)
+    {
+        const std::chrono::milliseconds delay =
+            backoff(j.attempts++, std::chrono::seconds(2),
+                    std::chrono::seconds(30));
+        // Waiting for the federation does not count against the deadline.
+        if (j.deadline != std::chrono::steady_clock::time_point::max())
+        {
+            j.deadline += delay;
+        }
+        // The worker is free for other mentions in the meantime.
+        if (_timers.schedule(delay, [this, j]
+                             { _parent_queue.push(j, j.account); }))
+        {
+            return;
+        }
+    }
+
+    if (j.parent_id.empty())
+    {
+        j.message = "I couldn't find the message you replied to. 😞 \n"
+                    "Maybe the federation is a bit wonky at the moment.";
+        enqueue(_reply_queue, j);
+    }
+    else
+    {
+        enqueue(_status_queue, j);
+    }
+}
+
+void Pipeline::fetch_status(job &j)
+{
+    {
+        stage_timer timer(Metrics::stage::status);
+        j.status = _status_flights.run(flight_key(j), [this, &j]
+        {
+            return _listeners[j.account]->get_status(j.parent_id);
+        });
+    }
+
+    if (!j.status.valid())
+    {
+        j.message = "I couldn't get the message you replied to. 😞";
+        enqueue(_reply_queue, j);
+    }
+    else
+    {
+        enqueue(_expand_queue, j);
+    }
+}
+
+void Pipeline::expand_urls(job &j)
+{
+    expansion result;
+    {
+        stage_timer timer(Metrics::stage::expand);
+        result = _url_flights.run(flight_key(j), [&j]
+        {
+            expansion e;
+            e.urls = get_urls(j.status.content(), j.deadline, e.complete);
+            return e;
+        });
+    }
+    // Once per mention, also for those that joined the flight.
+    get_metrics().count_deadline(result.complete);
+    const std::vector<string> &vec = result.urls;
+    j.message = std::accumulate(vec.begin(), vec.end(), string(),
+                                [](const string &s1, const string s2)
+                                { return s1 + s2 + " \n"; });
+    if (j.message.empty())
+    {
+        j.message = "I couldn't find an URL in the message you replied to. 😞";
+    }
+    enqueue(_reply_queue, j);
+}
+
+void Pipeline::reply(job &j)
+{
+    const string key = j.key;
+    std::unique_lock<std::mutex> lock(_sequences_mutex);
+    sequence &seq = _sequences[key];
+    seq.waiting.emplace(j.seq, std::move(j));
+
+    // Another thread is sending replies for this key and will pick it up.
+    if (seq.busy)
+    {
+        return;
+    }
+
+    seq.busy = true;
+    auto it = seq.waiting.find(seq.next_reply);
+    while (it != seq.waiting.end())
+    {
+        job next = std::move(it->second);
+        seq.waiting.erase(it);
+        lock.unlock();
+        const bool sent = send(next);
+        lock.lock();
+        // The later replies wait until the retry comes back.
+        if (!sent)
+        {
+            break;
+        }
+        ++seq.next_reply;
+        it = seq.waiting.find(seq.next_reply);
+    }
+    seq.busy = false;
+
+    if (seq.waiting.empty() && seq.next_reply == seq.next_ticket)
+    {
+        _sequences.erase(key);
+    }
+}
+
+bool Pipeline::send(job &j)
+{
+    using namespace std::chrono;
+
+    bool sent;
+    {
+        stage_timer timer(Metrics::stage::reply);
+        sent = _listeners[j.account]->send_reply(j.notif.status(), j.message);
+    }
+    if (sent)
+    {
+        _listeners[j.account]->mention_done(j.notif.id());
+    }
+    else
+    {
+        syslog(LOG_ERR, "could not send reply to %s", j.parent_id.c_str());
+        if (j.reply_attempts < max_reply_retries)
+        {
+            const milliseconds delay =
+                backoff(j.reply_attempts++, seconds(2), seconds(30));
+            // reply() puts it back in its place in the sequence.
+            if (_timers.schedule(delay, [this, j]
+                                 { _reply_queue.push(j, j.account); }))
+            {
+                return false;
+            }
+        }
+        // The mention stays unfinished, so that last_id does not move past
+        // it and it is answered after a restart.
+        syslog(LOG_ERR, "Giving up on the reply to %s.",
+               j.parent_id.c_str());
+    }
+    get_metrics().record_stage(Metrics::stage::mention,
+                               duration_cast<microseconds>(
+                                   steady_clock::now() - j.received));
+
+    return true;
+}
+
+std::size_t Pipeline::get_queue_size(const Metrics::stage s) const
+{
+    switch (s)
+    {
+        case Metrics::stage::parent:
+            return _parent_queue.size();
+        case Metrics::stage::status:
+            return _status_queue.size();
+        case Metrics::stage::expand:
+            return _expand_queue.size();
+        case Metrics::stage::reply:
+            return _reply_queue.size();
+        default:
+            return 0;
+    }
+}
@@ -0,0 +1,165 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <jsoncpp/json/json.h>
+#include "expandurl-mastodon.hpp"
+#include "queue.hpp"
+#include "singleflight.hpp"
+#include "timerwheel.hpp"
+#include "metrics.hpp"
+
+using std::string;
+
+/*!
+ *  @brief  Processes mentions in stages, each served by its own threads
+ *
+ *          The stages are: parent resolution, status fetch, URL expansion
+ *          and reply posting. They are connected by bounded queues, so a
+ *          slow stage makes push() block instead of using up memory.
+ *          Replies to the same post are sent in the order the mentions
+ *          arrived. Mentions under the same post that are processed at the
+ *          same time fetch the post and expand its URLs only once. If the
+ *          replied-to post is not known yet, the mention is retried later
+ *          without holding up the others. So is a reply that could not be
+ *          sent, the later replies to the same post wait for it.
+ *
+ *          URLs that are not expanded when the deadline of a mention is
+ *          reached are only filtered in the reply.
+ *
+ *          Several accounts can share one pipeline. Each account has its own
+ *          lane in every queue and the workers serve the lanes in turn, so a
+ *          busy account can not starve the others.
+ *
+ *          Example:
+ *  @code
+ *          Pipeline pipeline({ &listener }, config["workers"]);
+ *          pipeline.push(notif);
+ *          pipeline.stop();
+ *  @endcode
+ */
+class Pipeline
+{
+public:
+    /*!
+     *  @param  listeners   One per account, used for its Mastodon API calls
+     *  @param  config      The `workers` object of the config file
+     */
+    explicit Pipeline(const std::vector<Listener*> &listeners,
+                      const Json::Value &config);
+    ~Pipeline();
+
+    /*!
+     *  @brief  Adds a mention, waits if the lane of the account is full
+     *
+     *  @param  notif   The mention
+     *  @param  account Index of the listener that received it
+     *
+     *  @return `false` if the pipeline is stopped
+     */
+    bool push(const Easy::Notification &notif, const std::size_t account = 0);
+
+    /*!
+     *  @brief  Processes all queued mentions, then stops the threads
+     */
+    void stop();
+
+    /*!
+     *  @brief  Returns the number of mentions waiting in front of a stage
+     */
+    std::size_t get_queue_size(const Metrics::stage s) const;
+
+private:
+    struct job
+    {
+        Easy::Notification notif;
+        //! Index of the listener
+        std::size_t account = 0;
+        //! Replies with the same key are sent in order
+        string key;
+        std::uint64_t seq = 0;
+        //! Number of retries of the parent resolution
+        std::uint8_t attempts = 0;
+        //! Number of retries of the reply
+        std::uint8_t reply_attempts = 0;
+        string parent_id;
+        Easy::Status status;
+        string message;
+        //! When push() was called
+        std::chrono::steady_clock::time_point received;
+        //! When the reply should be sent at the latest
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    // The URLs of a post.
+    struct expansion
+    {
+        std::vector<string> urls;
+        //! All URLs were expanded before the deadline
+        bool complete = false;
+    };
+
+    // Keeps track of the replies for one key.
+    struct sequence
+    {
+        std::uint64_t next_ticket = 0;
+        std::uint64_t next_reply = 0;
+        bool busy = false;
+        std::map<std::uint64_t, job> waiting;
+    };
+
+    const std::vector<Listener*> _listeners;
+    // Time from receiving a mention to the reply, 0 for no limit.
+    const std::chrono::milliseconds _reply_deadline;
+    // Mentions that wait for a retry.
+    TimerWheel _timers;
+    Queue<job> _parent_queue;
+    Queue<job> _status_queue;
+    Queue<job> _expand_queue;
+    Queue<job> _reply_queue;
+    std::vector<std::thread> _parent_workers;
+    std::vector<std::thread> _status_workers;
+    std::vector<std::thread> _expand_workers;
+    std::vector<std::thread> _reply_workers;
+    std::map<string, sequence> _sequences;
+    std::mutex _sequences_mutex;
+    bool _stopped;
+    // Mentions under the same post share the work, by account and parent
+    // ID.
+    SingleFlight<string, Easy::Status> _status_flights;
+    SingleFlight<string, expansion> _url_flights;
+
+    bool enqueue(Queue<job> &queue, job &j);
+    // IDs are only unique per instance.
+    const string flight_key(const job &j) const;
+    void resolve_parent(job &j);
+    void fetch_status(job &j);
+    void expand_urls(job &j);
+    void reply(job &j);
+    // Returns `false` if the reply is retried later.
+    bool send(job &j);
+};
+
+#endif  // PIPELINE_HPP
@@ -0,0 +1,157 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QUEUE_HPP
+#define QUEUE_HPP
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+#include <utility>
+
+/*!
+ *  @brief  Bounded, blocking queue for passing work between threads
+ *
+ *          push() blocks while the queue is full, pop() blocks while it is
+ *          empty. After close(), push() fails and pop() returns the remaining
+ *          items, then fails.
+ *
+ *          The queue can be divided into lanes, one per producer. Each lane
+ *          holds up to `capacity` items and pop() takes from the lanes in
+ *          turn, so a producer that pushes a lot neither blocks the others
+ *          nor delays their items.
+ *
+ *          Example:
+ *  @code
+ *          Queue<int> queue(64);
+ *          queue.push(5);
+ *          int item;
+ *          while (queue.pop(item)) { … }
+ *  @endcode
+ */
+template <typename T>
+class Queue
+{
+public:
+    /*!
+     *  @param  capacity    Maximum number of items in each lane
+     *  @param  lanes       Number of lanes
+     */
+    explicit Queue(const std::size_t capacity, const std::size_t lanes = 1)
+    : _capacity(capacity > 0 ? capacity : 1)
+    , _closed(false)
+    , _lanes(lanes > 0 ? lanes : 1)
+    , _next(0)
+    , _size(0)
+    {}
+
+    /*!
+     *  @brief  Adds an item, waits while its lane is full
+     *
+     *  @return `false` if the queue is closed
+     */
+    bool push(T item, const std::size_t lane = 0)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        std::deque<T> &items = _lanes[lane < _lanes.size() ? lane : 0];
+        _not_full.wait(lock, [this, &items]
+                       { return _closed || items.size() < _capacity; });
+        if (_closed)
+        {
+            return false;
+        }
+        items.push_back(std::move(item));
+        ++_size;
+        lock.unlock();
+        _not_empty.notify_one();
+
+        return true;
+    }
+
+    /*!
+     *  @brief  Removes the oldest item of the next lane that has one, waits
+     *          while the queue is empty
+     *
+     *  @return `false` if the queue is closed and empty
+     */
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _not_empty.wait(lock, [this] { return _closed || _size > 0; });
+        if (_size == 0)
+        {
+            return false;
+        }
+        while (_lanes[_next].empty())
+        {
+            _next = (_next + 1) % _lanes.size();
+        }
+        std::deque<T> &items = _lanes[_next];
+        item = std::move(items.front());
+        items.pop_front();
+        --_size;
+        _next = (_next + 1) % _lanes.size();
+        lock.unlock();
+        // Waiting producers may belong to different lanes.
+        if (_lanes.size() > 1)
+        {
+            _not_full.notify_all();
+        }
+        else
+        {
+            _not_full.notify_one();
+        }
+
+        return true;
+    }
+
+    /*!
+     *  @brief  Rejects new items and wakes up all waiting threads
+     */
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _closed = true;
+        }
+        _not_empty.notify_all();
+        _not_full.notify_all();
+    }
+
+    /*!
+     *  @brief  Returns the number of items in all lanes
+     */
+    std::size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _size;
+    }
+
+private:
+    const std::size_t _capacity;
+    bool _closed;
+    std::vector<std::deque<T>> _lanes;
+    // Lane to take the next item from.
+    std::size_t _next;
+    std::size_t _size;
+    mutable std::mutex _mutex;
+    std::condition_variable _not_empty;
+    std::condition_variable _not_full;
+};
+
+#endif  // QUEUE_HPP
@@ -0,0 +1,170 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <ctime>
+#include <cstdlib>
+#include <syslog.h>
+#include "ratelimiter.hpp"
+
+using std::string;
+
+RateLimiter::RateLimiter(const std::uint32_t limit,
+                         const std::chrono::seconds &window)
+: _limit(limit > 0 ? limit : 1)
+, _tokens(_limit)
+, _window(window)
+, _reset(clock::now() + window)
+, _waiting({{ 0, 0 }})
+{}
+
+void RateLimiter::acquire(const priority prio)
+{
+    const std::size_t index = static_cast<std::size_t>(prio);
+    std::unique_lock<std::mutex> lock(_mutex);
+    ++_waiting[index];
+
+    while (true)
+    {
+        refill();
+        // Low priority calls wait for high priority calls and leave them a
+        // reserve.
+        const bool turn = (prio == priority::high)
+            || (_waiting[0] == 0 && _tokens > reserve());
+        if (turn && _tokens > 0)
+        {
+            --_tokens;
+            --_waiting[index];
+            break;
+        }
+
+        if (_tokens == 0)
+        {
+            syslog(LOG_DEBUG, "Rate limit reached, waiting for the next "
+                   "window.");
+        }
+        _cv.wait_until(lock, _reset);
+    }
+
+    lock.unlock();
+    // Someone else may be able to go now.
+    _cv.notify_all();
+}
+
+void RateLimiter::update(const string &limit, const string &remaining,
+                         const string &reset)
+{
+    if (remaining.empty())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        const unsigned long new_limit =
+            std::strtoul(limit.c_str(), nullptr, 10);
+        if (new_limit > 0)
+        {
+            _limit = static_cast<std::uint32_t>(new_limit);
+        }
+        clock::time_point new_reset;
+        if (parse_reset(reset, new_reset))
+        {
+            _reset = new_reset;
+        }
+        // The server knows better, but responses can arrive out of order.
+        const unsigned long left =
+            std::strtoul(remaining.c_str(), nullptr, 10);
+        if (left < _tokens)
+        {
+            _tokens = static_cast<std::uint32_t>(left);
+        }
+    }
+    // Waiters sleep until the old reset.
+    _cv.notify_all();
+}
+
+void RateLimiter::exhausted(const string &reset)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _tokens = 0;
+        clock::time_point new_reset;
+        if (parse_reset(reset, new_reset))
+        {
+            _reset = new_reset;
+        }
+        else if (_reset <= clock::now())
+        {
+            _reset = clock::now() + std::chrono::seconds(60);
+        }
+    }
+    // Waiters sleep until the old reset, they have to wait longer.
+    _cv.notify_all();
+    syslog(LOG_WARNING, "Rate limit exceeded, waiting for the next window.");
+}
+
+std::uint32_t RateLimiter::get_budget() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _tokens;
+}
+
+std::uint32_t RateLimiter::get_queue_depth() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _waiting[0] + _waiting[1];
+}
+
+void RateLimiter::refill()
+{
+    const clock::time_point now = clock::now();
+    if (now >= _reset)
+    {
+        _tokens = _limit;
+        while (_reset <= now)
+        {
+            _reset += _window;
+        }
+    }
+}
+
+std::uint32_t RateLimiter::reserve() const
+{
+    return _limit / 10;
+}
+
+bool RateLimiter::parse_reset(const string &reset,
+                              clock::time_point &time) const
+{
+    // 2019-04-12T15:00:00.492Z
+    std::tm tm = {};
+    if (std::sscanf(reset.c_str(), "%4d-%2d-%2dT%2d:%2d:%2d",
+                    &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                    &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+    {
+        return false;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+
+    const std::time_t reset_time = timegm(&tm);
+    const std::time_t now = std::time(nullptr);
+    // Add a second for clock differences.
+    time = clock::now() + std::chrono::seconds(reset_time - now + 1);
+
+    return true;
+}
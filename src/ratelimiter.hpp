@@ -0,0 +1,121 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RATELIMITER_HPP
+#define RATELIMITER_HPP
+
+#include <string>
+#include <array>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+
+using std::string;
+
+/*!
+ *  @brief  Keeps API calls within the rate limit of the instance
+ *
+ *          Mastodon allows a number of calls per 5 minutes and tells us in the
+ *          `X-RateLimit-*` headers how many are left and when the window
+ *          resets. Every call takes a token from the bucket; if there is none
+ *          left, acquire() waits until the window resets instead of letting
+ *          the call fail.
+ *
+ *          Calls with high priority go first, and low priority calls leave a
+ *          reserve of tokens for them.
+ *
+ *          Thread-safe.
+ *
+ *          Example:
+ *  @code
+ *          RateLimiter limiter;
+ *          limiter.acquire(RateLimiter::priority::low);
+ *          masto.get(…);
+ *          limiter.update(masto.get_header("X-RateLimit-Limit"),
+ *                         masto.get_header("X-RateLimit-Remaining"),
+ *                         masto.get_header("X-RateLimit-Reset"));
+ *  @endcode
+ */
+class RateLimiter
+{
+public:
+    enum class priority
+    {
+        high,
+        low
+    };
+
+    /*!
+     *  @param  limit   Calls per window, until the server tells us otherwise
+     *  @param  window  Length of a window
+     */
+    explicit RateLimiter(const std::uint32_t limit = 300,
+                         const std::chrono::seconds &window =
+                         std::chrono::seconds(300));
+
+    /*!
+     *  @brief  Takes a token, waits until one is available
+     */
+    void acquire(const priority prio);
+
+    /*!
+     *  @brief  Learns the budget from the headers of a response
+     *
+     *          Empty or invalid values are ignored.
+     *
+     *  @param  limit       Value of `X-RateLimit-Limit`
+     *  @param  remaining   Value of `X-RateLimit-Remaining`
+     *  @param  reset       Value of `X-RateLimit-Reset`, an ISO 8601 date
+     */
+    void update(const string &limit, const string &remaining,
+                const string &reset);
+
+    /*!
+     *  @brief  Empties the bucket after the server answered with 429
+     *
+     *  @param  reset   Value of `X-RateLimit-Reset`, may be empty
+     */
+    void exhausted(const string &reset);
+
+    /*!
+     *  @brief  Returns the number of calls left in this window
+     */
+    std::uint32_t get_budget() const;
+
+    /*!
+     *  @brief  Returns the number of calls waiting for a token
+     */
+    std::uint32_t get_queue_depth() const;
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    std::uint32_t _limit;
+    std::uint32_t _tokens;
+    const std::chrono::seconds _window;
+    clock::time_point _reset;
+    std::array<std::uint32_t, 2> _waiting;
+    mutable std::mutex _mutex;
+    std::condition_variable _cv;
+
+    // Refills the bucket if the window is over. Needs the lock.
+    void refill();
+    std::uint32_t reserve() const;
+    bool parse_reset(const string &reset, clock::time_point &time) const;
+};
+
+#endif  // RATELIMITER_HPP
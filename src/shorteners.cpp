@@ -0,0 +1,133 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include "urlparts.hpp"
+#include "shorteners.hpp"
+
+using std::string;
+
+namespace
+{
+    // Known URL shorteners. Must stay sorted, it is binary searched.
+    constexpr const char *known_shorteners[] =
+    {
+        "1drv.ms", "a.co", "adf.ly", "aka.ms", "amzn.eu",
+        "amzn.to", "apple.co", "bbc.in", "bddy.me", "bit.do",
+        "bit.ly", "bitly.com", "bl.ink", "buff.ly", "clck.ru",
+        "cnn.it", "cutt.ly", "db.tt", "dlvr.it", "ebay.to",
+        "econ.st", "etsy.me", "fb.me", "flic.kr", "forms.gle",
+        "g.co", "git.io", "goo.gl", "goo.gle", "hubs.la",
+        "hubs.ly", "huff.to", "ift.tt", "is.gd", "j.mp",
+        "ln.is", "lnk.to", "lnkd.in", "mcaf.ee", "msft.it",
+        "mzl.la", "n.pr", "nyti.ms", "on.ft.com", "ouo.io",
+        "ow.ly", "po.st", "politi.co", "qr.ae", "rb.gy",
+        "rebrand.ly", "redd.it", "reut.rs", "s.id", "shorte.st",
+        "shorturl.at", "shr.lc", "smarturl.it", "snip.ly", "spoti.fi",
+        "su.pr", "t.co", "t.ly", "theatln.tc", "ti.me",
+        "tiny.cc", "tinyurl.com", "tinyurl.is", "tr.im", "trib.al",
+        "trib.in", "u.to", "urlz.fr", "v.gd", "vk.cc",
+        "wapo.st", "wp.me", "x.co", "yhoo.it", "youtu.be",
+        "zurl.co"
+    };
+
+    // Checks host and all its parent domains against the built-in list.
+    bool is_known_shortener(const string &host)
+    {
+        const auto less = [](const char *a, const char *b)
+                          { return std::strcmp(a, b) < 0; };
+        size_t pos = 0;
+
+        while (pos != string::npos)
+        {
+            const char *domain = host.c_str() + pos;
+            if (std::binary_search(std::begin(known_shorteners),
+                                   std::end(known_shorteners), domain, less))
+            {
+                return true;
+            }
+            pos = host.find('.', pos);
+            if (pos != string::npos)
+            {
+                ++pos;
+            }
+        }
+
+        return false;
+    }
+
+    const std::vector<string> to_vector(const Json::Value &array)
+    {
+        std::vector<string> v;
+        for (const Json::Value &value : array)
+        {
+            string domain = value.asString();
+            std::transform(domain.begin(), domain.end(), domain.begin(),
+                           [](const unsigned char c)
+                           { return static_cast<char>(std::tolower(c)); });
+            v.push_back(domain);
+        }
+
+        return v;
+    }
+}
+
+HostClassifier::HostClassifier(const Json::Value &config)
+: _allow(to_vector(config["allow"]))
+, _deny(to_vector(config["deny"]))
+, _max_path_length(static_cast<std::uint16_t>(
+                       config.get("max_path_length", 12).asUInt()))
+, _expanded(0)
+, _skipped(0)
+{}
+
+bool HostClassifier::should_expand(const string &url)
+{
+    const string host = get_host(url);
+    bool expand;
+
+    if (host_matches(host, _deny))
+    {
+        expand = false;
+    }
+    else if (host_matches(host, _allow) || is_known_shortener(host))
+    {
+        expand = true;
+    }
+    else
+    {
+        // Short URLs look like https://example.com/a1b2.
+        const string path = get_path(url);
+        expand = (path.length() <= _max_path_length + 1u
+                  && url.find('?') == string::npos);
+    }
+
+    ++(expand ? _expanded : _skipped);
+
+    return expand;
+}
+
+std::uint64_t HostClassifier::get_expanded() const
+{
+    return _expanded;
+}
+
+std::uint64_t HostClassifier::get_skipped() const
+{
+    return _skipped;
+}
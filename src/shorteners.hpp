@@ -0,0 +1,75 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHORTENERS_HPP
+#define SHORTENERS_HPP
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <jsoncpp/json/json.h>
+
+using std::string;
+
+/*!
+ *  @brief  Decides which URLs are worth a network request
+ *
+ *          Hosts in the deny list are never expanded. Hosts in the allow list
+ *          and known URL shorteners, including their subdomains, are always
+ *          expanded. Other hosts are only expanded if the path is short and
+ *          there is no query, like `https://example.com/a1b2`.
+ *
+ *          Thread-safe.
+ *
+ *          Example:
+ *  @code
+ *          HostClassifier classifier(config["shorteners"]);
+ *          if (classifier.should_expand(url)) { … }
+ *  @endcode
+ */
+class HostClassifier
+{
+public:
+    /*!
+     *  @param  config  The `shorteners` object of the config file
+     */
+    explicit HostClassifier(const Json::Value &config);
+
+    /*!
+     *  @brief  Returns `true` if `url` probably redirects somewhere
+     */
+    bool should_expand(const string &url);
+
+    /*!
+     *  @brief  Number of URLs that should be expanded
+     */
+    std::uint64_t get_expanded() const;
+
+    /*!
+     *  @brief  Number of URLs for which a network request was saved
+     */
+    std::uint64_t get_skipped() const;
+
+private:
+    std::vector<string> _allow;
+    std::vector<string> _deny;
+    std::uint16_t _max_path_length;
+    std::atomic<std::uint64_t> _expanded;
+    std::atomic<std::uint64_t> _skipped;
+};
+
+#endif  // SHORTENERS_HPP
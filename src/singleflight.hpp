@@ -0,0 +1,141 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SINGLEFLIGHT_HPP
+#define SINGLEFLIGHT_HPP
+
+#include <map>
+#include <mutex>
+#include <future>
+#include <functional>
+#include <exception>
+#include <utility>
+
+/*!
+ *  @brief  Runs work only once for all threads that ask for the same key at
+ *          the same time
+ *
+ *          The first thread to ask for a key does the work, all others wait
+ *          for its result. The key is forgotten as soon as the result is
+ *          there, this is not a cache.
+ *
+ *          For batches, a thread can lead() several keys, do the work for all
+ *          of them at once and finish() them one by one. It must finish all
+ *          keys it leads before it waits for keys led by other threads.
+ *
+ *          Example:
+ *  @code
+ *          SingleFlight<string, Easy::Status> flights;
+ *          Easy::Status status = flights.run(id, [&] { return fetch(id); });
+ *  @endcode
+ */
+template <typename Key, typename Value>
+class SingleFlight
+{
+public:
+    /*!
+     *  @brief  Returns the result of `work`, or of the call that is already
+     *          running for `key`
+     */
+    Value run(const Key &key, const std::function<Value()> &work)
+    {
+        std::shared_future<Value> future;
+        if (!lead(key, future))
+        {
+            return future.get();
+        }
+
+        try
+        {
+            const Value value = work();
+            finish(key, value);
+            return value;
+        }
+        catch (...)
+        {
+            std::promise<Value> promise;
+            if (take(key, promise))
+            {
+                promise.set_exception(std::current_exception());
+            }
+            throw;
+        }
+    }
+
+    /*!
+     *  @brief  Registers the caller as the one doing the work for `key`
+     *
+     *  @param  key     The key
+     *  @param  future  Is set to the future of the result for `key`
+     *
+     *  @return `true` if the caller has to do the work and call finish(),
+     *          `false` if another thread is already doing it
+     */
+    bool lead(const Key &key, std::shared_future<Value> &future)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _flights.find(key);
+        if (it != _flights.end())
+        {
+            future = it->second.future;
+            return false;
+        }
+
+        flight &f = _flights[key];
+        f.future = f.promise.get_future().share();
+        future = f.future;
+
+        return true;
+    }
+
+    /*!
+     *  @brief  Hands the result for `key` to all waiting threads
+     */
+    void finish(const Key &key, const Value &value)
+    {
+        std::promise<Value> promise;
+        if (take(key, promise))
+        {
+            promise.set_value(value);
+        }
+    }
+
+private:
+    struct flight
+    {
+        std::promise<Value> promise;
+        std::shared_future<Value> future;
+    };
+
+    std::map<Key, flight> _flights;
+    std::mutex _mutex;
+
+    bool take(const Key &key, std::promise<Value> &promise)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _flights.find(key);
+        if (it == _flights.end())
+        {
+            return false;
+        }
+        promise = std::move(it->second.promise);
+        _flights.erase(it);
+
+        return true;
+    }
+};
+
+#endif  // SINGLEFLIGHT_HPP
@@ -0,0 +1,239 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <syslog.h>
+#include "sseparser.hpp"
+
+using std::string;
+using std::chrono::steady_clock;
+
+SSEParser::SSEParser(const std::vector<string> &types,
+                     const std::size_t buffer_size,
+                     const std::size_t max_pending)
+: _types(types)
+, _ring(buffer_size > 0 ? buffer_size : 1)
+, _ring_head(0)
+, _ring_size(0)
+, _scanned(0)
+, _discarding(false)
+, _overflow(false)
+, _pending(0)
+, _max_pending(max_pending)
+, _last_activity(steady_clock::now().time_since_epoch().count())
+, _dropped(0)
+{}
+
+std::size_t SSEParser::feed(const char *data, const std::size_t size,
+                            const std::atomic<bool> &cancel)
+{
+    const std::size_t capacity = _ring.size();
+    std::size_t completed = 0;
+    std::size_t pos = 0;
+
+    _last_activity = steady_clock::now().time_since_epoch().count();
+
+    while (pos < size)
+    {
+        if (_ring_size == capacity)
+        {
+            // A line that does not fit. Throw away everything up to the next
+            // newline and the event it belongs to.
+            syslog(LOG_WARNING, "Stream line longer than %zu bytes, "
+                   "dropping event.", capacity);
+            _ring_head = 0;
+            _ring_size = 0;
+            _scanned = 0;
+            _discarding = true;
+            _overflow = true;
+        }
+
+        // Copy as much as fits into the ring buffer.
+        const std::size_t n = std::min(capacity - _ring_size, size - pos);
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            _ring[(_ring_head + _ring_size + i) % capacity] = data[pos + i];
+        }
+        _ring_size += n;
+        pos += n;
+
+        // Take out all complete lines.
+        while (_scanned < _ring_size)
+        {
+            if (_ring[(_ring_head + _scanned) % capacity] != '\n')
+            {
+                ++_scanned;
+                continue;
+            }
+
+            string line;
+            line.reserve(_scanned);
+            for (std::size_t i = 0; i < _scanned; ++i)
+            {
+                line += _ring[(_ring_head + i) % capacity];
+            }
+            if (!line.empty() && line.back() == '\r')
+            {
+                line.pop_back();
+            }
+            _ring_head = (_ring_head + _scanned + 1) % capacity;
+            _ring_size -= _scanned + 1;
+            _scanned = 0;
+
+            if (_discarding)
+            {
+                _discarding = false;
+            }
+            else
+            {
+                parse_line(line, completed);
+            }
+        }
+    }
+
+    // Backpressure: Wait until the consumer catches up. We are not reading
+    // in the meantime, so the silence of the server does not count.
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_pending > _max_pending && !cancel)
+    {
+        _drained.wait_for(lock, std::chrono::seconds(1));
+        _last_activity = steady_clock::now().time_since_epoch().count();
+    }
+
+    return completed;
+}
+
+void SSEParser::parse_line(const string &line, std::size_t &completed)
+{
+    // An empty line ends the event.
+    if (line.empty())
+    {
+        if (_overflow)
+        {
+            // Only count events we would have kept.
+            if (_current.type.empty() || wanted(_current.type))
+            {
+                ++_dropped;
+            }
+        }
+        else if (!_current.data.empty())
+        {
+            if (_current.type.empty())
+            {
+                _current.type = "message";
+            }
+            if (wanted(_current.type))
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _pending += _current.data.size();
+                _events.push_back(std::move(_current));
+                ++completed;
+            }
+        }
+        _current = sse_event();
+        _overflow = false;
+        return;
+    }
+
+    // Comments are used as keep-alive packets.
+    if (line[0] == ':')
+    {
+        return;
+    }
+
+    const std::size_t colon = line.find(':');
+    const string field = line.substr(0, colon);
+    string value;
+    if (colon != string::npos)
+    {
+        value = line.substr(colon + 1);
+        if (!value.empty() && value[0] == ' ')
+        {
+            value.erase(0, 1);
+        }
+    }
+
+    if (field == "event")
+    {
+        _current.type = value;
+    }
+    else if (field == "data")
+    {
+        // Don't collect data we would throw away anyway.
+        if (!_current.type.empty() && !wanted(_current.type))
+        {
+            return;
+        }
+        if (!_current.data.empty())
+        {
+            _current.data += '\n';
+        }
+        _current.data += value;
+    }
+}
+
+bool SSEParser::wanted(const string &type) const
+{
+    return std::find(_types.begin(), _types.end(), type) != _types.end();
+}
+
+const std::vector<sse_event> SSEParser::take_events()
+{
+    std::vector<sse_event> events;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        events.reserve(_events.size());
+        std::move(_events.begin(), _events.end(), std::back_inserter(events));
+        _events.clear();
+        _pending = 0;
+    }
+    _drained.notify_all();
+
+    return events;
+}
+
+void SSEParser::reset()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _events.clear();
+        _pending = 0;
+    }
+    _ring_head = 0;
+    _ring_size = 0;
+    _scanned = 0;
+    _discarding = false;
+    _overflow = false;
+    _current = sse_event();
+    _last_activity = steady_clock::now().time_since_epoch().count();
+    _drained.notify_all();
+}
+
+steady_clock::time_point SSEParser::get_last_activity() const
+{
+    return steady_clock::time_point(steady_clock::duration(_last_activity));
+}
+
+std::size_t SSEParser::get_memory_usage() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _ring.size() + _pending;
+}
+
+std::uint64_t SSEParser::get_dropped() const
+{
+    return _dropped;
+}
@@ -0,0 +1,152 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SSEPARSER_HPP
+#define SSEPARSER_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+
+using std::string;
+
+/*!
+ *  @brief  An event from a server-sent events stream
+ */
+struct sse_event
+{
+    //! Value of the `event:` field
+    string type;
+    //! All `data:` lines, joined with newlines
+    string data;
+};
+
+/*!
+ *  @brief  Incremental parser for server-sent events
+ *
+ *          The receiving thread calls feed() with whatever arrived. Incomplete
+ *          lines wait in a ring buffer of fixed size, complete events whose
+ *          type was asked for are queued until the consumer takes them with
+ *          take_events(). The lock is only held to move finished events in
+ *          and out of the queue.
+ *
+ *          Backpressure policy:
+ *          - Events with other types are dropped while parsing and never use
+ *            memory.
+ *          - If the queued events use more than `max_pending` bytes, feed()
+ *            blocks until the consumer has taken them, or `cancel` becomes
+ *            `true`. The receiving thread stops reading from the socket then,
+ *            and TCP flow control slows the server down.
+ *          - A single line longer than the ring buffer can not be parsed. The
+ *            event it belongs to is dropped and counted.
+ *
+ *          Example:
+ *  @code
+ *          SSEParser parser({ "notification" }, 1024 * 1024, 4 * 1024 * 1024);
+ *          parser.feed(data, size, cancel);    // receiving thread
+ *          for (const sse_event &event : parser.take_events()) { … }
+ *  @endcode
+ */
+class SSEParser
+{
+public:
+    /*!
+     *  @param  types       Event types to keep
+     *  @param  buffer_size Size of the ring buffer in bytes
+     *  @param  max_pending Maximum size of queued events in bytes
+     */
+    explicit SSEParser(const std::vector<string> &types,
+                       const std::size_t buffer_size,
+                       const std::size_t max_pending);
+
+    /*!
+     *  @brief  Parses received data
+     *
+     *          Blocks while too many events are queued, see backpressure
+     *          policy.
+     *
+     *  @param  data    Received data
+     *  @param  size    Size of data in bytes
+     *  @param  cancel  Stop waiting if this becomes `true`
+     *
+     *  @return Number of events that were completed
+     */
+    std::size_t feed(const char *data, const std::size_t size,
+                     const std::atomic<bool> &cancel);
+
+    /*!
+     *  @brief  Takes all completed events out of the queue
+     */
+    const std::vector<sse_event> take_events();
+
+    /*!
+     *  @brief  Forgets everything, for a new connection
+     */
+    void reset();
+
+    /*!
+     *  @brief  Time of the last feed(), including keep-alive comments
+     *
+     *          While feed() waits for the consumer, it is updated every
+     *          second.
+     */
+    std::chrono::steady_clock::time_point get_last_activity() const;
+
+    /*!
+     *  @brief  Bytes used by incomplete lines and queued events
+     */
+    std::size_t get_memory_usage() const;
+
+    /*!
+     *  @brief  Number of events that were dropped because a line was too
+     *          long
+     */
+    std::uint64_t get_dropped() const;
+
+private:
+    const std::vector<string> _types;
+    // Ring buffer for incomplete lines. Only used by the receiving thread.
+    std::vector<char> _ring;
+    std::size_t _ring_head;
+    std::size_t _ring_size;
+    // Where to continue searching for '\n'.
+    std::size_t _scanned;
+    // Skipping the rest of a line that was too long.
+    bool _discarding;
+    // The current event lost a line and will be dropped.
+    bool _overflow;
+    // Event that is being parsed. Only used by the receiving thread.
+    sse_event _current;
+
+    std::deque<sse_event> _events;
+    std::size_t _pending;
+    const std::size_t _max_pending;
+    mutable std::mutex _mutex;
+    std::condition_variable _drained;
+
+    std::atomic<std::int64_t> _last_activity;
+    std::atomic<std::uint64_t> _dropped;
+
+    void parse_line(const string &line, std::size_t &completed);
+    bool wanted(const string &type) const;
+};
+
+#endif  // SSEPARSER_HPP
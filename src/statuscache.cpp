@@ -0,0 +1,79 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "statuscache.hpp"
+
+using std::string;
+
+StatusCache::StatusCache(const std::size_t size)
+: _size(size)
+, _hits(0)
+, _misses(0)
+{}
+
+bool StatusCache::get(const string &id, Easy::Status &status)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _index.find(id);
+    if (it == _index.end())
+    {
+        ++_misses;
+        return false;
+    }
+
+    // Move to the front.
+    _entries.splice(_entries.begin(), _entries, it->second);
+    status = it->second->second;
+    ++_hits;
+
+    return true;
+}
+
+void StatusCache::put(const Easy::Status &status)
+{
+    if (_size == 0 || !status.valid() || status.id().empty())
+    {
+        return;
+    }
+
+    const string id = status.id();
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _index.find(id);
+    if (it != _index.end())
+    {
+        it->second->second = status;
+        _entries.splice(_entries.begin(), _entries, it->second);
+        return;
+    }
+
+    _entries.emplace_front(id, status);
+    _index[id] = _entries.begin();
+    if (_entries.size() > _size)
+    {
+        _index.erase(_entries.back().first);
+        _entries.pop_back();
+    }
+}
+
+std::uint64_t StatusCache::get_hits() const
+{
+    return _hits;
+}
+
+std::uint64_t StatusCache::get_misses() const
+{
+    return _misses;
+}
@@ -0,0 +1,94 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATUSCACHE_HPP
+#define STATUSCACHE_HPP
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <mastodon-cpp/easy/all.hpp>
+
+using std::string;
+using namespace Mastodon;
+
+/*!
+ *  @brief  Keeps the most recently used statuses in memory
+ *
+ *          Filled with statuses from the stream and from API calls, so that
+ *          they don't have to be fetched again. When it is full, the least
+ *          recently used status is dropped.
+ *
+ *          Thread-safe.
+ *
+ *          Example:
+ *  @code
+ *          StatusCache cache(1024);
+ *          cache.put(notif.status());
+ *          Easy::Status status;
+ *          if (cache.get(id, status)) { … }
+ *  @endcode
+ */
+class StatusCache
+{
+public:
+    /*!
+     *  @param  size    Maximum number of statuses, 0 disables the cache
+     */
+    explicit StatusCache(const std::size_t size);
+
+    /*!
+     *  @brief  Looks up a status
+     *
+     *  @param  id      ID of the status
+     *  @param  status  Is set to the status if it is found
+     *
+     *  @return `true` if the status was found
+     */
+    bool get(const string &id, Easy::Status &status);
+
+    /*!
+     *  @brief  Adds or replaces a status. Invalid statuses are ignored.
+     */
+    void put(const Easy::Status &status);
+
+    /*!
+     *  @brief  Number of successful lookups
+     */
+    std::uint64_t get_hits() const;
+
+    /*!
+     *  @brief  Number of failed lookups
+     */
+    std::uint64_t get_misses() const;
+
+private:
+    using entry = std::pair<string, Easy::Status>;
+
+    const std::size_t _size;
+    // Most recently used first.
+    std::list<entry> _entries;
+    std::unordered_map<string, std::list<entry>::iterator> _index;
+    std::mutex _mutex;
+    std::atomic<std::uint64_t> _hits;
+    std::atomic<std::uint64_t> _misses;
+};
+
+#endif  // STATUSCACHE_HPP
@@ -0,0 +1,138 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <random>
+#include <algorithm>
+#include <utility>
+#include "timerwheel.hpp"
+
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+
+TimerWheel::TimerWheel(const milliseconds &tick, const std::size_t slots)
+: _tick(tick.count() > 0 ? tick : milliseconds(1))
+, _slots(slots > 0 ? slots : 1)
+, _current(0)
+, _stopped(false)
+, _thread(&TimerWheel::run, this)
+{}
+
+TimerWheel::~TimerWheel()
+{
+    stop();
+}
+
+bool TimerWheel::schedule(const milliseconds &delay, callback cb)
+{
+    // The current slot is processed at the next tick.
+    const std::uint64_t ticks =
+        std::max<std::uint64_t>(1, (delay.count() + _tick.count() - 1)
+                                   / _tick.count());
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_stopped)
+    {
+        return false;
+    }
+    const std::size_t slot = (_current + (ticks - 1)) % _slots.size();
+    _slots[slot].push_back({ (ticks - 1) / _slots.size(), std::move(cb) });
+
+    return true;
+}
+
+void TimerWheel::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_stopped)
+        {
+            return;
+        }
+        _stopped = true;
+    }
+    _cv.notify_all();
+    _thread.join();
+
+    // Nobody else touches the slots anymore.
+    for (std::vector<timer> &slot : _slots)
+    {
+        for (timer &t : slot)
+        {
+            t.cb();
+        }
+        slot.clear();
+    }
+}
+
+void TimerWheel::run()
+{
+    steady_clock::time_point next_tick = steady_clock::now() + _tick;
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (!_stopped)
+    {
+        if (_cv.wait_until(lock, next_tick, [this] { return _stopped; }))
+        {
+            break;
+        }
+
+        // Catch up if we fell behind.
+        std::vector<callback> due;
+        while (steady_clock::now() >= next_tick)
+        {
+            std::vector<timer> &slot = _slots[_current];
+            auto it = std::partition(slot.begin(), slot.end(),
+                                     [](const timer &t)
+                                     { return t.rounds > 0; });
+            for (auto fired = it; fired != slot.end(); ++fired)
+            {
+                due.push_back(std::move(fired->cb));
+            }
+            slot.erase(it, slot.end());
+            for (timer &t : slot)
+            {
+                --t.rounds;
+            }
+            _current = (_current + 1) % _slots.size();
+            next_tick += _tick;
+        }
+
+        lock.unlock();
+        for (const callback &cb : due)
+        {
+            cb();
+        }
+        lock.lock();
+    }
+}
+
+milliseconds backoff(const std::uint8_t attempt, const milliseconds &base,
+                     const milliseconds &max)
+{
+    static thread_local std::mt19937 generator(std::random_device{}());
+
+    milliseconds delay = base;
+    for (std::uint8_t i = 0; i < attempt && delay < max; ++i)
+    {
+        delay *= 2;
+    }
+    delay = std::min(delay, max);
+
+    std::uniform_int_distribution<milliseconds::rep>
+        distribution(delay.count() / 2, delay.count());
+
+    return milliseconds(distribution(generator));
+}
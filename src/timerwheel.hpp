@@ -0,0 +1,111 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TIMERWHEEL_HPP
+#define TIMERWHEEL_HPP
+
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+
+/*!
+ *  @brief  Runs callbacks after a delay, on its own thread
+ *
+ *          Timers are sorted into slots of a wheel that turns once per tick,
+ *          so adding a timer and firing it costs the same no matter how many
+ *          there are. Timers fire up to one tick late.
+ *
+ *          Callbacks run one after another and should only hand work to
+ *          another thread, like pushing into a Queue.
+ *
+ *          Thread-safe.
+ *
+ *          Example:
+ *  @code
+ *          TimerWheel timers;
+ *          timers.schedule(backoff(attempt, std::chrono::seconds(2),
+ *                                  std::chrono::seconds(60)),
+ *                          [&queue, job] { queue.push(job); });
+ *  @endcode
+ */
+class TimerWheel
+{
+public:
+    using callback = std::function<void()>;
+
+    /*!
+     *  @param  tick    Time the wheel needs to advance one slot
+     *  @param  slots   Number of slots
+     */
+    explicit TimerWheel(const std::chrono::milliseconds &tick =
+                        std::chrono::milliseconds(100),
+                        const std::size_t slots = 512);
+    ~TimerWheel();
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    /*!
+     *  @brief  Runs `cb` after `delay`
+     *
+     *  @return `false` if the wheel is stopped, `cb` is not run then
+     */
+    bool schedule(const std::chrono::milliseconds &delay, callback cb);
+
+    /*!
+     *  @brief  Runs all pending callbacks now and rejects new timers
+     */
+    void stop();
+
+private:
+    struct timer
+    {
+        //! Full turns of the wheel until the timer fires
+        std::uint64_t rounds;
+        callback cb;
+    };
+
+    const std::chrono::milliseconds _tick;
+    std::vector<std::vector<timer>> _slots;
+    std::size_t _current;
+    bool _stopped;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::thread _thread;
+
+    void run();
+};
+
+/*!
+ *  @brief  Exponential back-off with jitter
+ *
+ *          Doubles `base` for every attempt, up to `max`, and returns a random
+ *          delay between half of that and all of it, so that retries of many
+ *          clients don't arrive at the same time.
+ *
+ *  @param  attempt Number of previous attempts, starting at 0
+ *  @param  base    Delay for the first retry
+ *  @param  max     Maximum delay
+ */
+std::chrono::milliseconds backoff(const std::uint8_t attempt,
+                                  const std::chrono::milliseconds &base,
+                                  const std::chrono::milliseconds &max);
+
+#endif  // TIMERWHEEL_HPP
@@ -0,0 +1,197 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <syslog.h>
+#include "urlparts.hpp"
+#include "expandurl-mastodon.hpp"
+
+using std::string;
+
+namespace
+{
+    /*
+     *  A wrapper URL has a host in `domain` (or a subdomain of it) and a path
+     *  beginning with `path`. The target is either in the query parameter
+     *  `param`, or, if `param` is empty, the rest of the path, prefixed with
+     *  `prefix`.
+     */
+    struct unwrap_rule
+    {
+        std::vector<string> domain;
+        string path;
+        string param;
+        string prefix;
+    };
+    using unwrap_rules = std::vector<unwrap_rule>;
+
+    std::shared_ptr<const unwrap_rules> current_unwrap_rules =
+        std::make_shared<const unwrap_rules>();
+
+    // Wrappers inside wrappers are unwrapped up to this depth.
+    constexpr std::uint8_t max_depth = 5;
+
+    bool is_http(const string &url)
+    {
+        return url.compare(0, 7, "http://") == 0
+            || url.compare(0, 8, "https://") == 0;
+    }
+
+    // Returns the target, or an empty string if the rule does not match.
+    const string apply(const unwrap_rule &rule, const string &url,
+                       const string &host, const string &path)
+    {
+        if (!host_matches(host, rule.domain)
+            || path.compare(0, rule.path.length(), rule.path) != 0)
+        {
+            return "";
+        }
+
+        if (!rule.param.empty())
+        {
+            return percent_decode(get_query_param(url, rule.param));
+        }
+
+        // Everything after the path prefix, including the query.
+        const size_t pos = url.find(rule.path, url.find("://") + 3);
+        return rule.prefix + url.substr(pos + rule.path.length());
+    }
+
+    // Returns the number of invalid rules, they are skipped.
+    std::uint16_t parse_rules(const Json::Value &unwrap, unwrap_rules &rules)
+    {
+        std::uint16_t errors = 0;
+
+        for (const Json::Value &rule : unwrap)
+        {
+            const string domain = rule["host"].asString();
+            const string param = rule["param"].asString();
+            const string prefix = rule["prefix"].asString();
+            if (domain.empty() || (param.empty() && prefix.empty()))
+            {
+                syslog(LOG_ERR, "Invalid unwrap rule for \"%s\", it needs "
+                       "host and param or prefix.", domain.c_str());
+                ++errors;
+                continue;
+            }
+            rules.push_back({ { domain }, rule.get("path", "/").asString(),
+                              param, prefix });
+        }
+
+        return errors;
+    }
+}
+
+const string unwrap(const string &url)
+{
+    const std::shared_ptr<const unwrap_rules> rules =
+        std::atomic_load(&current_unwrap_rules);
+    string current = url;
+
+    for (std::uint8_t depth = 0; depth < max_depth; ++depth)
+    {
+        const string host = get_host(current);
+        const string path = get_path(current);
+        string target;
+
+        for (const unwrap_rule &rule : *rules)
+        {
+            target = apply(rule, current, host, path);
+            if (!target.empty())
+            {
+                break;
+            }
+        }
+
+        if (!is_http(target))
+        {
+            break;
+        }
+        syslog(LOG_DEBUG, "Unwrapped %s to %s", current.c_str(),
+               target.c_str());
+        current = target;
+    }
+
+    return current;
+}
+
+void init_unwrap_rules()
+{
+    Json::Value &config = configfile.get_json();
+    if (config["unwrap"].isNull())
+    {
+        const std::vector<std::vector<string>> defaults =
+        {
+            // host, path, param, prefix
+            { "google.com", "/url", "q", "" },
+            { "google.com", "/url", "url", "" },
+            { "google.com", "/amp/s/", "", "https://" },
+            { "google.com", "/amp/", "", "http://" },
+            { "cdn.ampproject.org", "/c/s/", "", "https://" },
+            { "cdn.ampproject.org", "/c/", "", "http://" },
+            { "cdn.ampproject.org", "/v/s/", "", "https://" },
+            { "cdn.ampproject.org", "/v/", "", "http://" },
+            { "facebook.com", "/l.php", "u", "" },
+            { "l.instagram.com", "/", "u", "" },
+            { "out.reddit.com", "/", "url", "" },
+            { "safelinks.protection.outlook.com", "/", "url", "" },
+            { "youtube.com", "/redirect", "q", "" },
+            { "t.umblr.com", "/redirect", "z", "" },
+            { "steamcommunity.com", "/linkfilter/", "url", "" }
+        };
+
+        for (const std::vector<string> &rule : defaults)
+        {
+            Json::Value entry;
+            entry["host"] = rule[0];
+            entry["path"] = rule[1];
+            if (!rule[2].empty())
+            {
+                entry["param"] = rule[2];
+            }
+            else
+            {
+                entry["prefix"] = rule[3];
+            }
+            config["unwrap"].append(entry);
+        }
+    }
+
+    auto rules = std::make_shared<unwrap_rules>();
+    parse_rules(config["unwrap"], *rules);
+    std::atomic_store(&current_unwrap_rules,
+                      std::shared_ptr<const unwrap_rules>(rules));
+}
+
+bool reload_unwrap_rules(const Json::Value &unwrap)
+{
+    auto rules = std::make_shared<unwrap_rules>();
+    if (parse_rules(unwrap, *rules) > 0)
+    {
+        syslog(LOG_ERR, "Keeping the old unwrap rules.");
+        return false;
+    }
+
+    std::atomic_store(&current_unwrap_rules,
+                      std::shared_ptr<const unwrap_rules>(rules));
+    syslog(LOG_NOTICE, "Loaded %zu unwrap rules.", rules->size());
+
+    return true;
+}
@@ -18,81 +18,386 @@
 #include <sstream>
 #include <regex>
 #include <array>
+#include <map>
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <mutex>
 #include <utility>
+#include <memory>
+#include <atomic>
+#include <chrono>
 #include <syslog.h>
-#include <curlpp/cURLpp.hpp>
-#include <curlpp/Options.hpp>
-#include <curlpp/Infos.hpp>
-#include "version.hpp"
+#include "expander.hpp"
+#include "html.hpp"
+#include "shorteners.hpp"
+#include "urlcache.hpp"
+#include "urlparts.hpp"
+#include "singleflight.hpp"
+#include "metrics.hpp"
+#include "workerpool.hpp"
 #include "expandurl-mastodon.hpp"
 
 using std::string;
-namespace curlopts = curlpp::options;
 
-const std::vector<string> get_urls(const string &html)
+namespace
 {
-    const std::regex re_url("href=\\\\?\"([^\"\\\\]+)\\\\?\"([^>]+)");
-    std::smatch match;
-    string buffer = html;
-    std::vector<string> v;
+    std::shared_ptr<const replacements> current_replacements =
+        std::make_shared<const replacements>();
 
-    while (std::regex_search(buffer, match, re_url))
+    /*!
+     *  @brief  Compiles the replacements in `replace`
+     *
+     *          Rules that the URLFilter understands don't need a regular
+     *          expression. The filter runs first, so it only takes the rules
+     *          in front of the first one it does not understand, the order
+     *          stays the same.
+     *
+     *  @return Number of invalid patterns, they are skipped.
+     */
+    std::uint16_t compile_replacements(const Json::Value &replace,
+                                       replacements &rules)
     {
-        // Add URL to vector if it is not a mention.#
-        if (match[2].str().find("mention") == std::string::npos)
+        using namespace std::regex_constants;
+        std::uint16_t errors = 0;
+        bool filtering = true;
+
+        for (auto it = replace.begin(); it != replace.end(); ++it)
         {
-            string url = unescape_html(match[1].str());
-            v.push_back(strip(expand(url)));
+            if (filtering && rules.filter.add_rule(it.name(),
+                                                   (*it).asString()))
+            {
+                continue;
+            }
+            filtering = false;
+            try
+            {
+                rules.regexes.push_back(
+                    { std::regex(it.name(), icase | optimize),
+                      (*it).asString() });
+            }
+            catch (const std::regex_error &e)
+            {
+                syslog(LOG_ERR, "Invalid replacement \"%s\": %s",
+                       it.name().c_str(), e.what());
+                ++errors;
+            }
         }
-        buffer = match.suffix().str();
+
+        return errors;
     }
 
-    return v;
+    /*!
+     *  @brief  Returns a copy of the `expand` section of the config file
+     *
+     *          Copied once, so that the expanding threads don't read the
+     *          config while it is changed or written.
+     */
+    const Json::Value &get_expand_config()
+    {
+        static const Json::Value config = []
+        {
+            // Through a const reference, so that a missing key is not
+            // inserted.
+            const Json::Value &json = configfile.get_json();
+            return json["expand"];
+        }();
+
+        return config;
+    }
+
+    const expander_options read_expander_options()
+    {
+        const Json::Value &config = get_expand_config();
+        expander_options options;
+        options.max_concurrent = static_cast<std::uint16_t>(
+            config.get("max_concurrent", 8).asUInt());
+        options.max_hops = static_cast<std::uint8_t>(
+            config.get("max_hops", 10).asUInt());
+        options.deadline = std::chrono::milliseconds(
+            config.get("deadline", 30000).asUInt());
+        for (const Json::Value &domain : config["final_domains"])
+        {
+            options.final_domains.push_back(domain.asString());
+        }
+        options.breaker = &get_circuit_breaker();
+
+        return options;
+    }
+
+    Expander &get_expander()
+    {
+        // The settings are read only once, not by every thread.
+        static const expander_options options = read_expander_options();
+        static ConnectionPool pool(static_cast<std::uint16_t>(
+            get_expand_config().get("max_host_connections", 2).asUInt()));
+        static thread_local Expander expander(pool, options);
+
+        return expander;
+    }
+
+    // URLs that are being expanded right now, by normalized URL.
+    SingleFlight<string, expand_result> expansions;
+
+    // Expansions that go on after get_urls() returned.
+    std::vector<std::future<void>> background;
+    std::mutex background_mutex;
+    // Beyond that, get_urls() expands in its own thread and ignores the
+    // deadline.
+    constexpr std::size_t max_background = 64;
+
+    /*!
+     *  @brief  Runs `work` in a new thread
+     *
+     *  @return `false` if too many are running already
+     */
+    bool run_in_background(const std::function<void()> &work)
+    {
+        std::lock_guard<std::mutex> lock(background_mutex);
+        background.erase(std::remove_if(
+            background.begin(), background.end(),
+            [](const std::future<void> &f)
+            {
+                return f.wait_for(std::chrono::seconds(0))
+                    == std::future_status::ready;
+            }), background.end());
+        if (background.size() >= max_background)
+        {
+            syslog(LOG_NOTICE, "Too many expansions running, "
+                   "ignoring the deadline.");
+            return false;
+        }
+        background.push_back(std::async(std::launch::async, work));
+
+        return true;
+    }
+
+    URLCache &get_cache()
+    {
+        const Json::Value &config = configfile.get_json();
+        static URLCache cache("cache", "expandurl-mastodon",
+                              config["cache"].get("slots", 8192).asUInt());
+
+        return cache;
+    }
 }
 
-const string expand(const string &url)
+CircuitBreaker &get_circuit_breaker()
 {
-    curlpp::Easy request;
-    std::stringstream ss;
+    const Json::Value &config = get_expand_config();
+    static CircuitBreaker breaker(
+        static_cast<std::uint16_t>(config.get("max_failures", 3).asUInt()),
+        std::chrono::seconds(config.get("retry_after", 30).asUInt()));
+
+    return breaker;
+}
+
+HostClassifier &get_classifier()
+{
+    // Through a const reference, so that a missing key is not inserted.
+    static HostClassifier classifier(static_cast<const Json::Value&>
+                                     (configfile.get_json())["shorteners"]);
+
+    return classifier;
+}
+
+const std::vector<string> get_urls(const string &html)
+{
+    bool complete;
+    return get_urls(html, std::chrono::steady_clock::time_point::max(),
+                    complete);
+}
+
+const std::vector<string> get_urls(
+    const string &html, const std::chrono::steady_clock::time_point &deadline,
+    bool &complete)
+{
+    std::vector<string> v = extract_urls(html);
+    for (string &url : v)
+    {
+        url = unwrap(url);
+    }
+
+    const Json::Value &config = configfile.get_json();
+    const std::uint32_t ttl = config["cache"].get("ttl", 604800).asUInt();
+    const std::uint32_t negative_ttl =
+        config["cache"].get("negative_ttl", 600).asUInt();
+    const std::uint32_t unavailable_ttl =
+        config["cache"].get("unavailable_ttl", 60).asUInt();
+    URLCache &cache = get_cache();
+    HostClassifier &classifier = get_classifier();
+    // Every URL is only expanded once, even if it appears several times or
+    // another thread is already expanding it.
+    std::map<string, std::vector<std::size_t>> misses;
+
+    for (std::size_t i = 0; i < v.size(); ++i)
+    {
+        string cached;
+        bool negative = false;
+        if (!classifier.should_expand(v[i]))
+        {
+            v[i] = strip(v[i]);
+        }
+        else if (cache.get(v[i], cached, negative))
+        {
+            get_metrics().count_cache_hit();
+            // Filtered now, the rules may have been reloaded since.
+            v[i] = strip(negative ? v[i] : cached);
+        }
+        else
+        {
+            misses[normalize_url(v[i])].push_back(i);
+        }
+    }
 
-    request.setOpt(curlopts::WriteStream(&ss));
-    request.setOpt<curlopts::CustomRequest>("HEAD");
-    request.setOpt<curlopts::Url>(url);
-    request.setOpt<curlopts::UserAgent>
-        (static_cast<const string>("expandurl-mastodon/") + global::version);
-    request.setOpt<curlopts::HttpHeader>(
+    // Keys of the flights we lead.
+    std::vector<string> own;
+    // The URLs as they were found, they are expanded and cached. The keys
+    // lack the fragment and the case of scheme and host, which redirectors
+    // may need.
+    std::vector<string> originals;
+    std::map<string, std::shared_future<expand_result>> futures;
+    for (const auto &miss : misses)
     {
-        "Connection: close",
-    });
-    request.setOpt<curlopts::FollowLocation>(true);
-    request.setOpt(curlopts::Timeout(30));
+        if (expansions.lead(miss.first, futures[miss.first]))
+        {
+            own.push_back(miss.first);
+            originals.push_back(v[miss.second.front()]);
+        }
+    }
+
+    // Expand all URLs we lead at once. Every result is cached and handed to
+    // the waiting threads as soon as it is there, even after the deadline.
+    const auto work = [own, originals, ttl, negative_ttl, unavailable_ttl]
+    {
+        URLCache &cache = get_cache();
+        std::vector<bool> done(own.size(), false);
+        const auto finished = [&](const std::size_t i,
+                                  const expand_result &result)
+        {
+            std::chrono::milliseconds latency(0);
+            for (const expand_hop &hop : result.hops)
+            {
+                latency += hop.latency;
+            }
+            get_metrics().record_expansion(get_host(originals[i]), latency,
+                                           result.ok);
+            if (result.ok)
+            {
+                cache.put(originals[i], result.url, ttl);
+            }
+            else
+            {
+                // The host may be back soon, try again earlier.
+                cache.put(originals[i], "", (result.unavailable
+                                             ? unavailable_ttl
+                                             : negative_ttl), true);
+            }
+            expansions.finish(own[i], result);
+            done[i] = true;
+        };
+
+        try
+        {
+            std::vector<expand_result> expanded;
+            if (get_worker_pool().is_running()
+                && get_worker_pool().expand(originals, expanded))
+            {
+                for (std::size_t i = 0; i < expanded.size(); ++i)
+                {
+                    finished(i, expanded[i]);
+                }
+            }
+            else
+            {
+                get_expander().expand(originals, finished);
+            }
+        }
+        catch (const std::exception &e)
+        {
+            syslog(LOG_ERR, "Could not expand URLs: %s", e.what());
+        }
+        catch (...)
+        {
+            syslog(LOG_ERR, "Could not expand URLs.");
+        }
+
+        // Other threads wait for the keys we lead, without a timeout.
+        for (std::size_t i = 0; i < own.size(); ++i)
+        {
+            if (!done[i])
+            {
+                expansions.finish(own[i], { originals[i], false, {} });
+            }
+        }
+    };
 
-    try
+    const bool has_deadline =
+        (deadline != std::chrono::steady_clock::time_point::max());
+    if (!own.empty() && !(has_deadline && run_in_background(work)))
     {
-        request.perform();
+        work();
     }
-    catch (const std::exception &e)
+
+    // If the expansion failed, result.url is the last URL we got to. URLs
+    // that are not expanded in time are only filtered.
+    complete = true;
+    for (const auto &future : futures)
     {
-        syslog(LOG_ERR, "%s", e.what());
-        // TODO: Do something when: "Couldn't resolve host …"
-        syslog(LOG_NOTICE, "The previous error is ignored.");
+        string url;
+        if (!has_deadline || future.second.wait_until(deadline)
+            == std::future_status::ready)
+        {
+            url = strip(future.second.get().url);
+        }
+        else
+        {
+            complete = false;
+            url = strip(v[misses[future.first].front()]);
+        }
+        for (const std::size_t i : misses[future.first])
+        {
+            v[i] = url;
+        }
     }
 
-    return curlpp::infos::EffectiveUrl::get(request);
+    return v;
+}
+
+void finish_expansions()
+{
+    std::lock_guard<std::mutex> lock(background_mutex);
+    for (std::future<void> &f : background)
+    {
+        f.wait();
+    }
+    background.clear();
+}
+
+const string expand(const string &url)
+{
+    return get_expander().expand({ url }).front().url;
+}
+
+const std::vector<expand_result> expand_urls(const std::vector<string> &urls)
+{
+    return get_expander().expand(urls);
 }
 
 const string strip(const string &url)
 {
-    using namespace std::regex_constants;
-    Json::Value &config = configfile.get_json();
-    string newurl = url;
+    // Hold on to the rules, so that a reload does not affect this URL.
+    const std::shared_ptr<const replacements> rules =
+        std::atomic_load(&current_replacements);
+    string newurl = rules->filter.filter(url);
+    if (rules->regexes.empty())
+    {
+        return newurl;
+    }
 
-    for (auto it = config["replace"].begin(); it != config["replace"].end();
-         ++it)
+    for (const replacement &rule : rules->regexes)
     {
-        newurl = std::regex_replace(newurl,
-                                    std::regex(it.name(), icase),
-                                    (*it).asString());
+        newurl = std::regex_replace(newurl, rule.re, rule.replace);
     }
 
     // If '&' is found in the new URL, but no '?'
@@ -127,4 +432,26 @@ void init_replacements()
             config["replace"][pair.first] = pair.second;
         }
     }
+
+    auto rules = std::make_shared<replacements>();
+    compile_replacements(config["replace"], *rules);
+    std::atomic_store(&current_replacements,
+                      std::shared_ptr<const replacements>(rules));
+}
+
+bool reload_replacements(const Json::Value &replace)
+{
+    auto rules = std::make_shared<replacements>();
+    if (compile_replacements(replace, *rules) > 0)
+    {
+        syslog(LOG_ERR, "Keeping the old replacements.");
+        return false;
+    }
+
+    std::atomic_store(&current_replacements,
+                      std::shared_ptr<const replacements>(rules));
+    syslog(LOG_NOTICE, "Loaded %zu replacements.",
+           rules->filter.size() + rules->regexes.size());
+
+    return true;
 }
@@ -0,0 +1,297 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <experimental/filesystem>
+#include <basedir.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "urlcache.hpp"
+
+using std::string;
+namespace fs = std::experimental::filesystem;
+
+namespace
+{
+    constexpr char magic[8] = { 'E', 'X', 'P', 'U', 'R', 'L', 'C', '1' };
+    constexpr std::uint32_t layout_version = 1;
+    constexpr std::size_t header_size = 64;
+    constexpr std::uint32_t probe_window = 8;
+
+    constexpr std::uint8_t flag_used = 1;
+    constexpr std::uint8_t flag_negative = 2;
+
+    std::uint64_t fnv1a64(const char *data, const std::size_t len)
+    {
+        std::uint64_t hash = 0xcbf29ce484222325ULL;
+        for (std::size_t i = 0; i < len; ++i)
+        {
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 0x100000001b3ULL;
+        }
+
+        return hash;
+    }
+}
+
+struct URLCache::header
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t slots;
+    std::uint32_t slot_size;
+};
+
+// Fixed layout, 2 KiB per slot. Key and value are stored back to back in
+// data, without terminating zeros.
+struct URLCache::slot
+{
+    std::uint64_t hash;
+    std::int64_t expires;
+    std::uint32_t checksum;
+    std::uint16_t key_len;
+    std::uint16_t value_len;
+    std::uint8_t flags;
+    char padding[7];
+    char data[2016];
+
+    std::uint32_t calculate_checksum() const
+    {
+        std::uint64_t sum = fnv1a64(data, key_len + value_len);
+        sum ^= hash + static_cast<std::uint64_t>(expires) + flags;
+        sum ^= (static_cast<std::uint64_t>(key_len) << 16) + value_len;
+
+        return static_cast<std::uint32_t>(sum ^ (sum >> 32));
+    }
+
+    bool valid() const
+    {
+        return (flags & flag_used)
+            && static_cast<std::size_t>(key_len + value_len) <= sizeof(data)
+            && checksum == calculate_checksum();
+    }
+
+    bool matches(const std::uint64_t h, const string &key) const
+    {
+        return hash == h && key_len == key.length()
+            && std::memcmp(data, key.data(), key_len) == 0;
+    }
+};
+
+URLCache::URLCache(const string &filename, const string &subdir,
+                   const std::uint32_t slots)
+: _slots(slots)
+, _fd(-1)
+, _map(nullptr)
+, _mapsize(header_size + static_cast<std::size_t>(slots) * sizeof(slot))
+{
+    xdgHandle xdg;
+    xdgInitHandle(&xdg);
+    _filepath = xdgDataHome(&xdg);
+    xdgWipeHandle(&xdg);
+
+    if (!subdir.empty())
+    {
+        _filepath += '/' + subdir;
+    }
+
+    if (_slots > 0)
+    {
+        std::error_code ec;
+        fs::create_directories(_filepath, ec);
+        _filepath += '/' + filename;
+        if (!open_file())
+        {
+            syslog(LOG_WARNING, "Could not open cache %s, caching disabled.",
+                   _filepath.c_str());
+        }
+    }
+    else
+    {
+        _filepath += '/' + filename;
+    }
+}
+
+URLCache::~URLCache()
+{
+    if (_map != nullptr)
+    {
+        munmap(_map, _mapsize);
+    }
+    if (_fd != -1)
+    {
+        close(_fd);
+    }
+}
+
+bool URLCache::open_file()
+{
+    _fd = open(_filepath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (_fd == -1)
+    {
+        return false;
+    }
+
+    struct stat st;
+    bool fresh = (fstat(_fd, &st) != 0
+                  || static_cast<std::size_t>(st.st_size) != _mapsize);
+    if (fresh)
+    {
+        // Throw away everything if the size does not match.
+        if (ftruncate(_fd, 0) != 0
+            || ftruncate(_fd, static_cast<off_t>(_mapsize)) != 0)
+        {
+            close(_fd);
+            _fd = -1;
+            return false;
+        }
+    }
+
+    _map = mmap(nullptr, _mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (_map == MAP_FAILED)
+    {
+        _map = nullptr;
+        close(_fd);
+        _fd = -1;
+        return false;
+    }
+
+    header *head = static_cast<header*>(_map);
+    if (!fresh && (std::memcmp(head->magic, magic, sizeof(magic)) != 0
+                   || head->version != layout_version
+                   || head->slots != _slots
+                   || head->slot_size != sizeof(slot)))
+    {
+        syslog(LOG_NOTICE, "Cache layout changed, recreating %s.",
+               _filepath.c_str());
+        fresh = true;
+    }
+    if (fresh)
+    {
+        std::memset(_map, 0, _mapsize);
+        head->version = layout_version;
+        head->slots = _slots;
+        head->slot_size = sizeof(slot);
+        std::memcpy(head->magic, magic, sizeof(magic));
+        msync(_map, _mapsize, MS_ASYNC);
+    }
+
+    return true;
+}
+
+URLCache::slot *URLCache::get_slot(const std::uint32_t index) const
+{
+    static_assert(sizeof(slot) == 2048,
+                  "Changing the slot layout requires a new layout_version.");
+
+    return reinterpret_cast<slot*>(static_cast<char*>(_map) + header_size)
+        + (index % _slots);
+}
+
+bool URLCache::get(const string &url, string &expanded, bool &negative)
+{
+    if (!usable())
+    {
+        return false;
+    }
+
+    const std::uint64_t hash = fnv1a64(url.data(), url.length());
+    const std::int64_t now = std::time(nullptr);
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    for (std::uint32_t i = 0; i < probe_window; ++i)
+    {
+        const slot *s = get_slot(static_cast<std::uint32_t>(hash % _slots) + i);
+        if (s->valid() && s->matches(hash, url))
+        {
+            if (s->expires < now)
+            {
+                return false;
+            }
+            expanded.assign(s->data + s->key_len, s->value_len);
+            negative = (s->flags & flag_negative);
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void URLCache::put(const string &url, const string &expanded,
+                   const std::uint32_t ttl, const bool negative)
+{
+    if (!usable() || url.length() + expanded.length() > sizeof(slot::data))
+    {
+        return;
+    }
+
+    const std::uint64_t hash = fnv1a64(url.data(), url.length());
+    const std::int64_t now = std::time(nullptr);
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    // Use the slot with the same key, or a free or expired one. If there
+    // is none, evict the entry that would expire first.
+    slot *target = nullptr;
+    for (std::uint32_t i = 0; i < probe_window; ++i)
+    {
+        slot *s = get_slot(static_cast<std::uint32_t>(hash % _slots) + i);
+        if (!s->valid() || s->matches(hash, url))
+        {
+            target = s;
+            break;
+        }
+        if (s->expires < now)
+        {
+            target = s;
+        }
+        else if (target == nullptr || (target->expires >= now
+                                       && s->expires < target->expires))
+        {
+            target = s;
+        }
+    }
+
+    // Invalidate first, so that a crash leaves no half-written entry.
+    target->flags = 0;
+    target->checksum = 0;
+    std::atomic_signal_fence(std::memory_order_release);
+    target->hash = hash;
+    target->expires = now + ttl;
+    target->key_len = static_cast<std::uint16_t>(url.length());
+    target->value_len = static_cast<std::uint16_t>(expanded.length());
+    std::memcpy(target->data, url.data(), url.length());
+    std::memcpy(target->data + url.length(), expanded.data(),
+                expanded.length());
+    std::atomic_signal_fence(std::memory_order_release);
+    target->flags = flag_used | (negative ? flag_negative : 0);
+    target->checksum = target->calculate_checksum();
+}
+
+bool URLCache::usable() const
+{
+    return _map != nullptr;
+}
+
+const string URLCache::get_filepath() const
+{
+    return _filepath;
+}
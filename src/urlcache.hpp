@@ -0,0 +1,116 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef URLCACHE_HPP
+#define URLCACHE_HPP
+
+#include <string>
+#include <mutex>
+#include <cstdint>
+
+using std::string;
+
+/*!
+ *  @brief  Persistent cache for expanded URLs
+ *
+ *          The cache is a hash table with a fixed number of fixed-size
+ *          slots, stored in a memory-mapped file. It survives restarts and
+ *          crashes; slots that were written partially are detected by a
+ *          checksum and ignored. If the probe window of a key is full, the
+ *          entry that expires first is evicted.
+ *
+ *          Example:
+ *  @code
+ *          URLCache cache("cache", "expandurl-mastodon", 8192);
+ *          string expanded;
+ *          bool negative;
+ *          if (!cache.get(url, expanded, negative))
+ *          {
+ *              cache.put(url, expand(url), 3600);
+ *          }
+ *  @endcode
+ */
+class URLCache
+{
+public:
+    /*!
+     *  @brief  Opens or creates the cache file in `${XDG_DATA_HOME}`
+     *
+     *          If the file has a different layout, it is recreated.
+     *
+     *  @param  filename  The name of the file
+     *  @param  subdir    The subdir (optional)
+     *  @param  slots     Number of entries the cache can hold. 0 disables the
+     *                    cache.
+     */
+    explicit URLCache(const string &filename, const string &subdir = "",
+                      const std::uint32_t slots = 8192);
+    ~URLCache();
+
+    URLCache(const URLCache &) = delete;
+    URLCache &operator=(const URLCache &) = delete;
+
+    /*!
+     *  @brief  Looks up an URL
+     *
+     *  @param  url       The unexpanded URL
+     *  @param  expanded  Is set to the cached result
+     *  @param  negative  Is set to `true` if the expansion failed last time
+     *
+     *  @return `true` if a valid entry was found
+     */
+    bool get(const string &url, string &expanded, bool &negative);
+
+    /*!
+     *  @brief  Stores an URL
+     *
+     *          URLs that do not fit into a slot are not cached.
+     *
+     *  @param  url       The unexpanded URL
+     *  @param  expanded  The expanded URL, unfiltered so that changed rules
+     *                    apply to it
+     *  @param  ttl       Time to live in seconds
+     *  @param  negative  `true` if the expansion failed
+     */
+    void put(const string &url, const string &expanded,
+             const std::uint32_t ttl, const bool negative = false);
+
+    /*!
+     *  @brief  Returns `true` if the cache file could be mapped
+     */
+    bool usable() const;
+
+    /*!
+     *  @brief  Gets the complete filepath
+     */
+    const string get_filepath() const;
+
+private:
+    struct header;
+    struct slot;
+
+    string _filepath;
+    std::uint32_t _slots;
+    int _fd;
+    void *_map;
+    std::size_t _mapsize;
+    std::mutex _mutex;
+
+    bool open_file();
+    slot *get_slot(const std::uint32_t index) const;
+};
+
+#endif  // URLCACHE_HPP
@@ -0,0 +1,307 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <array>
+#include <algorithm>
+#include "urlfilter.hpp"
+
+using std::string;
+
+namespace
+{
+    char lower(const char c)
+    {
+        return (c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c);
+    }
+
+    const string to_lower(string str)
+    {
+        std::transform(str.begin(), str.end(), str.begin(), lower);
+        return str;
+    }
+
+    // `str` from `pos` begins with `prefix`, which is lowercase.
+    bool starts_with(const string &str, const std::size_t pos,
+                     const std::size_t end, const string &prefix)
+    {
+        if (end - pos < prefix.size())
+        {
+            return false;
+        }
+
+        return std::equal(prefix.begin(), prefix.end(), str.begin() + pos,
+                          [](const char p, const char c)
+                          { return p == lower(c); });
+    }
+
+    /*!
+     *  @brief  Reads literal characters of a regular expression, until a
+     *          special character
+     *
+     *  @return Position after the literal
+     */
+    std::size_t read_literal(const string &pattern, std::size_t pos,
+                             string &literal)
+    {
+        static const string special = ".^$|()[]{}*+?\\";
+        while (pos < pattern.size())
+        {
+            const char c = pattern[pos];
+            if (c == '\\' && pos + 1 < pattern.size()
+                && special.find(pattern[pos + 1]) != string::npos)
+            {
+                literal += pattern[pos + 1];
+                pos += 2;
+            }
+            else if (special.find(c) == string::npos)
+            {
+                literal += c;
+                ++pos;
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        return pos;
+    }
+
+    // Replaces `directory` (like `/amp/`) in `path` with `/`, or removes it at
+    // the end of the path.
+    void remove_directory(string &path, const string &directory)
+    {
+        std::size_t pos = 0;
+        while (pos + directory.size() <= path.size())
+        {
+            if (!starts_with(path, pos, path.size(), directory))
+            {
+                ++pos;
+            }
+            else if (pos + directory.size() == path.size())
+            {
+                path.erase(pos);
+            }
+            else
+            {
+                path.erase(pos + 1, directory.size() - 1);
+            }
+        }
+    }
+}
+
+URLFilter::URLFilter()
+: _nodes(1)
+, _size(0)
+{}
+
+bool URLFilter::add_rule(const string &pattern, const string &replace)
+{
+    static const std::array<string, 4> param_starts =
+        {{ "[\\?&]", "[?&]", "[&\\?]", "[&?]" }};
+    static const string value = "[^&]+";
+    string literal;
+
+    for (const string &start : param_starts)
+    {
+        if (!replace.empty() || pattern.compare(0, start.size(), start) != 0)
+        {
+            continue;
+        }
+
+        std::size_t pos = read_literal(pattern, start.size(), literal);
+        if (literal.empty() || literal.find_first_of("&#") != string::npos)
+        {
+            return false;
+        }
+        if (pos == pattern.size())
+        {
+            insert(literal, false);
+            return true;
+        }
+
+        // [^&]+ takes the optional character if it is there.
+        if (pattern[pos] == '?')
+        {
+            literal.pop_back();
+            ++pos;
+        }
+        if (literal.empty() || pattern.compare(pos, string::npos, value) != 0)
+        {
+            return false;
+        }
+        insert(literal, true);
+        return true;
+    }
+
+    if (replace == "//" && pattern.compare(0, 2, "//") == 0)
+    {
+        if (read_literal(pattern, 2, literal) != pattern.size()
+            || literal.size() < 2 || literal.back() != '.'
+            || literal.find_first_of("/?#&") != string::npos)
+        {
+            return false;
+        }
+        _host_prefixes.push_back(to_lower(literal));
+        ++_size;
+        return true;
+    }
+
+    if (replace.empty() && pattern.compare(0, 1, "/") == 0)
+    {
+        if (read_literal(pattern, 1, literal) != pattern.size()
+            || literal.size() < 2
+            || literal.find_first_of("/?#&") != literal.size() - 1)
+        {
+            return false;
+        }
+        _directories.push_back('/' + to_lower(literal));
+        ++_size;
+        return true;
+    }
+
+    return false;
+}
+
+void URLFilter::insert(const string &key, const bool prefix)
+{
+    std::uint32_t index = 0;
+    for (const char c : to_lower(key))
+    {
+        const auto &children = _nodes[index].children;
+        auto it = std::find_if(children.begin(), children.end(),
+                               [c](const std::pair<char, std::uint32_t> &child)
+                               { return child.first == c; });
+        if (it != children.end())
+        {
+            index = it->second;
+            continue;
+        }
+
+        const std::uint32_t child = static_cast<std::uint32_t>(_nodes.size());
+        _nodes[index].children.emplace_back(c, child);
+        _nodes.emplace_back();
+        index = child;
+    }
+
+    (prefix ? _nodes[index].prefix : _nodes[index].exact) = true;
+    ++_size;
+}
+
+bool URLFilter::remove_param(const char *begin, const char *end) const
+{
+    std::uint32_t index = 0;
+    for (const char *c = begin; ; ++c)
+    {
+        const node &n = _nodes[index];
+        if (c == end)
+        {
+            return n.exact;
+        }
+        if (n.prefix)
+        {
+            return true;
+        }
+
+        const char l = lower(*c);
+        auto it = std::find_if(n.children.begin(), n.children.end(),
+                               [l](const std::pair<char, std::uint32_t> &child)
+                               { return child.first == l; });
+        if (it == n.children.end())
+        {
+            return false;
+        }
+        index = it->second;
+    }
+}
+
+const string URLFilter::filter(const string &url) const
+{
+    if (_size == 0)
+    {
+        return url;
+    }
+
+    string result;
+    result.reserve(url.size());
+
+    // Only URLs with a scheme have a host.
+    std::size_t host = 0;
+    std::size_t host_end = 0;
+    const std::size_t first = url.find_first_of("/?#");
+    if (first != string::npos && first > 0
+        && url.compare(first - 1, 3, "://") == 0)
+    {
+        host = first + 2;
+        host_end = std::min(url.find_first_of("/?#", host), url.size());
+    }
+    result.append(url, 0, host);
+    for (const string &prefix : _host_prefixes)
+    {
+        if (starts_with(url, host, host_end, prefix))
+        {
+            host += prefix.size();
+        }
+    }
+    result.append(url, host, host_end - host);
+
+    const std::size_t path_end = std::min(url.find_first_of("?#", host_end),
+                                          url.size());
+    if (_directories.empty())
+    {
+        result.append(url, host_end, path_end - host_end);
+    }
+    else
+    {
+        string path = url.substr(host_end, path_end - host_end);
+        for (const string &directory : _directories)
+        {
+            remove_directory(path, directory);
+        }
+        result += path;
+    }
+
+    const std::size_t fragment = std::min(url.find('#', path_end),
+                                          url.size());
+    if (path_end < url.size() && url[path_end] == '?')
+    {
+        bool first_param = true;
+        std::size_t begin = path_end + 1;
+        while (true)
+        {
+            const std::size_t end = std::min(url.find('&', begin), fragment);
+            if (!remove_param(url.data() + begin, url.data() + end))
+            {
+                result += (first_param ? '?' : '&');
+                result.append(url, begin, end - begin);
+                first_param = false;
+            }
+            if (end == fragment)
+            {
+                break;
+            }
+            begin = end + 1;
+        }
+    }
+    result.append(url, fragment, string::npos);
+
+    return result;
+}
+
+std::size_t URLFilter::size() const
+{
+    return _size;
+}
@@ -0,0 +1,101 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef URLFILTER_HPP
+#define URLFILTER_HPP
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+using std::string;
+
+/*!
+ *  @brief  Removes tracking parameters and rewrites hosts and paths, without
+ *          regular expressions
+ *
+ *          The URL is split once into scheme, host, path, query and fragment.
+ *          Query parameters are looked up in a prefix trie, host and path
+ *          rules only look at the host and the path. Case is ignored.
+ *
+ *          add_rule() understands these forms of replacement rules:
+ *          - `[\?&]utm_[^&]+` → `""`: Removes parameters that begin with
+ *            `utm_` and are longer than that. An optional last character,
+ *            like in `wt_?`, is allowed.
+ *          - `[\?&]service=amp` → `""`: Removes the parameter `service=amp`.
+ *          - `//amp\.` → `//`: Removes `amp.` from the beginning of the host.
+ *          - `/amp/` → `""`: Removes the directory `amp` from the path.
+ *
+ *          Not thread-safe while rules are added, filter() can be called from
+ *          many threads.
+ *
+ *          Example:
+ *  @code
+ *          URLFilter filter;
+ *          if (!filter.add_rule("[\\?&]utm_[^&]+", "")) { … use a regex … }
+ *          const string url = filter.filter(
+ *              "https://example.com/?utm_source=x&id=5");
+ *  @endcode
+ */
+class URLFilter
+{
+public:
+    URLFilter();
+
+    /*!
+     *  @brief  Adds a rule, if it has one of the supported forms
+     *
+     *  @param  pattern     The regular expression of the rule
+     *  @param  replace     The replacement
+     *
+     *  @return `false` if the rule is not supported
+     */
+    bool add_rule(const string &pattern, const string &replace);
+
+    /*!
+     *  @brief  Applies all rules to `url`
+     */
+    const string filter(const string &url) const;
+
+    /*!
+     *  @brief  Returns the number of rules
+     */
+    std::size_t size() const;
+
+private:
+    struct node
+    {
+        std::vector<std::pair<char, std::uint32_t>> children;
+        //! Parameters that begin with this and are longer are removed
+        bool prefix = false;
+        //! Parameters that are exactly this are removed
+        bool exact = false;
+    };
+
+    // The root is _nodes[0].
+    std::vector<node> _nodes;
+    //! Removed from the beginning of the host, like `amp.`
+    std::vector<string> _host_prefixes;
+    //! Directories that are removed from the path, like `/amp/`
+    std::vector<string> _directories;
+    std::size_t _size;
+
+    void insert(const string &key, const bool prefix);
+    bool remove_param(const char *begin, const char *end) const;
+};
+
+#endif  // URLFILTER_HPP
@@ -0,0 +1,173 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include "urlparts.hpp"
+
+using std::string;
+
+const string get_host(const string &url)
+{
+    size_t begin = url.find("://");
+    if (begin == string::npos)
+    {
+        return "";
+    }
+    begin += 3;
+
+    const size_t end = url.find_first_of("/?#", begin);
+    string host = url.substr(begin, end == string::npos ? end : end - begin);
+
+    // Remove user:password@
+    const size_t at = host.rfind('@');
+    if (at != string::npos)
+    {
+        host.erase(0, at + 1);
+    }
+    // Remove port, but not the colons of IPv6 addresses.
+    const size_t colon = host.rfind(':');
+    if (colon != string::npos && host.find(']', colon) == string::npos)
+    {
+        host.erase(colon);
+    }
+
+    std::transform(host.begin(), host.end(), host.begin(),
+                   [](const unsigned char c)
+                   { return static_cast<char>(std::tolower(c)); });
+
+    return host;
+}
+
+bool host_matches(const string &host, const std::vector<string> &domains)
+{
+    for (const string &domain : domains)
+    {
+        if (host == domain)
+        {
+            return true;
+        }
+        if (host.length() > domain.length()
+            && host[host.length() - domain.length() - 1] == '.'
+            && host.compare(host.length() - domain.length(), string::npos,
+                            domain) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+const string percent_decode(const string &str)
+{
+    const auto hex = [](const char c) -> int
+    {
+        if (c >= '0' && c <= '9')
+        {
+            return c - '0';
+        }
+        if (c >= 'a' && c <= 'f')
+        {
+            return c - 'a' + 10;
+        }
+        if (c >= 'A' && c <= 'F')
+        {
+            return c - 'A' + 10;
+        }
+        return -1;
+    };
+    string out;
+    out.reserve(str.length());
+
+    for (size_t i = 0; i < str.length(); ++i)
+    {
+        if (str[i] == '%' && i + 2 < str.length()
+            && hex(str[i + 1]) != -1 && hex(str[i + 2]) != -1)
+        {
+            out += static_cast<char>(hex(str[i + 1]) * 16 + hex(str[i + 2]));
+            i += 2;
+        }
+        else
+        {
+            out += str[i];
+        }
+    }
+
+    return out;
+}
+
+const string get_query_param(const string &url, const string &name)
+{
+    size_t pos = url.find('?');
+    const size_t end = url.find('#');
+
+    while (pos != string::npos && pos < end)
+    {
+        ++pos;
+        size_t next = url.find('&', pos);
+        if (next > end)
+        {
+            next = end;
+        }
+        if (url.compare(pos, name.length(), name) == 0
+            && pos + name.length() < url.length()
+            && url[pos + name.length()] == '=')
+        {
+            const size_t value = pos + name.length() + 1;
+            return url.substr(value, next == string::npos
+                                     ? next : next - value);
+        }
+        pos = next;
+    }
+
+    return "";
+}
+
+const string get_path(const string &url)
+{
+    size_t begin = url.find("://");
+    begin = url.find_first_of("/?#", begin == string::npos ? 0 : begin + 3);
+    if (begin == string::npos || url[begin] != '/')
+    {
+        return "/";
+    }
+    const size_t end = url.find_first_of("?#", begin);
+
+    return url.substr(begin, end == string::npos ? end : end - begin);
+}
+
+const string normalize_url(const string &url)
+{
+    string normalized = url.substr(0, url.find('#'));
+
+    const size_t begin = normalized.find("://");
+    if (begin == string::npos)
+    {
+        return normalized;
+    }
+    size_t end = normalized.find_first_of("/?", begin + 3);
+    if (end == string::npos)
+    {
+        end = normalized.length();
+    }
+    std::transform(normalized.begin(), normalized.begin() + end,
+                   normalized.begin(),
+                   [](const unsigned char c)
+                   { return static_cast<char>(std::tolower(c)); });
+
+    return normalized;
+}
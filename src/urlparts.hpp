@@ -0,0 +1,69 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef URLPARTS_HPP
+#define URLPARTS_HPP
+
+#include <string>
+#include <vector>
+
+using std::string;
+
+/*!
+ *  @brief  Returns the host of an URL, in lowercase, without port
+ *
+ *  @return The host, or an empty string if there is none
+ */
+const string get_host(const string &url);
+
+/*!
+ *  @brief  Checks if `host` is one of `domains` or a subdomain of one
+ *
+ *          `domains` must be lowercase.
+ */
+bool host_matches(const string &host, const std::vector<string> &domains);
+
+/*!
+ *  @brief  Decodes %XX sequences
+ *
+ *          Invalid sequences are copied verbatim.
+ */
+const string percent_decode(const string &str);
+
+/*!
+ *  @brief  Returns the value of a query parameter, not decoded
+ *
+ *  @param  url     The URL
+ *  @param  name    Name of the parameter
+ *
+ *  @return The value, or an empty string if the parameter is not found
+ */
+const string get_query_param(const string &url, const string &name);
+
+/*!
+ *  @brief  Returns the path of an URL, without query and fragment
+ */
+const string get_path(const string &url);
+
+/*!
+ *  @brief  Returns the URL with scheme and host in lowercase and without
+ *          fragment
+ *
+ *          Two URLs with the same normalized form lead to the same resource.
+ */
+const string normalize_url(const string &url);
+
+#endif  // URLPARTS_HPP
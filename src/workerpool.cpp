@@ -0,0 +1,794 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <syslog.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "timerwheel.hpp"
+#include "workerpool.hpp"
+
+extern char **environ;
+
+using std::string;
+using std::chrono::steady_clock;
+
+namespace
+{
+    // Larger frames are a protocol error.
+    constexpr std::uint32_t max_frame = 16 * 1024 * 1024;
+    constexpr std::size_t max_string = 0xffff;
+
+    // Builds a frame: length, type, job ID, body.
+    class frame_writer
+    {
+    public:
+        explicit frame_writer(const char type, const std::uint32_t id)
+        : _data(4, '\0')
+        {
+            put8(static_cast<std::uint8_t>(type));
+            put32(id);
+        }
+
+        void put8(const std::uint8_t value)
+        {
+            _data += static_cast<char>(value);
+        }
+
+        void put16(const std::uint16_t value)
+        {
+            put8(static_cast<std::uint8_t>(value >> 8));
+            put8(static_cast<std::uint8_t>(value & 0xff));
+        }
+
+        void put32(const std::uint32_t value)
+        {
+            put16(static_cast<std::uint16_t>(value >> 16));
+            put16(static_cast<std::uint16_t>(value & 0xffff));
+        }
+
+        void put_string(const string &value)
+        {
+            const std::size_t size = std::min(value.size(), max_string);
+            put16(static_cast<std::uint16_t>(size));
+            _data.append(value, 0, size);
+        }
+
+        // Fills in the length.
+        const string &finish()
+        {
+            const std::uint32_t size =
+                static_cast<std::uint32_t>(_data.size() - 4);
+            for (std::uint8_t i = 0; i < 4; ++i)
+            {
+                _data[i] = static_cast<char>((size >> (24 - i * 8)) & 0xff);
+            }
+
+            return _data;
+        }
+
+    private:
+        string _data;
+    };
+
+    // Reads the payload of a frame. Reading past the end sets ok() to false.
+    class frame_reader
+    {
+    public:
+        explicit frame_reader(const string &payload)
+        : _data(payload)
+        , _pos(0)
+        , _ok(true)
+        {}
+
+        std::uint8_t get8()
+        {
+            if (_pos >= _data.size())
+            {
+                _ok = false;
+                return 0;
+            }
+            return static_cast<std::uint8_t>(_data[_pos++]);
+        }
+
+        std::uint16_t get16()
+        {
+            const std::uint16_t high = get8();
+            return static_cast<std::uint16_t>((high << 8) | get8());
+        }
+
+        std::uint32_t get32()
+        {
+            const std::uint32_t high = get16();
+            return (high << 16) | get16();
+        }
+
+        const string get_string()
+        {
+            const std::size_t size = get16();
+            if (_pos + size > _data.size())
+            {
+                _ok = false;
+                return "";
+            }
+            const string value = _data.substr(_pos, size);
+            _pos += size;
+
+            return value;
+        }
+
+        bool ok() const
+        {
+            return _ok;
+        }
+
+    private:
+        const string &_data;
+        std::size_t _pos;
+        bool _ok;
+    };
+
+    bool read_full(const int fd, char *data, std::size_t size)
+    {
+        while (size > 0)
+        {
+            const ssize_t n = recv(fd, data, size, 0);
+            if (n == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return false;
+            }
+            data += n;
+            size -= static_cast<std::size_t>(n);
+        }
+
+        return true;
+    }
+
+    bool write_full(const int fd, const string &data)
+    {
+        std::size_t written = 0;
+        while (written < data.size())
+        {
+            // MSG_NOSIGNAL: A dead peer must not kill us with SIGPIPE.
+            const ssize_t n = send(fd, data.data() + written,
+                                   data.size() - written, MSG_NOSIGNAL);
+            if (n == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n == -1)
+            {
+                return false;
+            }
+            written += static_cast<std::size_t>(n);
+        }
+
+        return true;
+    }
+
+    bool read_frame(const int fd, string &payload)
+    {
+        char header[4];
+        if (!read_full(fd, header, sizeof(header)))
+        {
+            return false;
+        }
+        std::uint32_t size = 0;
+        for (const char byte : header)
+        {
+            size = (size << 8) | static_cast<std::uint8_t>(byte);
+        }
+        // Type and job ID are always there.
+        if (size < 5 || size > max_frame)
+        {
+            syslog(LOG_ERR, "Invalid frame of %u bytes.", size);
+            return false;
+        }
+        payload.resize(size);
+
+        return read_full(fd, &payload[0], size);
+    }
+
+    bool make_address(const string &path, sockaddr_un &address)
+    {
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path))
+        {
+            syslog(LOG_ERR, "Socket path too long: %s", path.c_str());
+            return false;
+        }
+        std::strncpy(address.sun_path, path.c_str(),
+                     sizeof(address.sun_path) - 1);
+
+        return true;
+    }
+
+    // The URLs unchanged, for jobs that were lost.
+    const std::vector<expand_result> failed(const std::vector<string> &urls)
+    {
+        std::vector<expand_result> results;
+        for (const string &url : urls)
+        {
+            results.push_back({ url, false, {} });
+        }
+
+        return results;
+    }
+}
+
+WorkerPool::connection::connection(const int socket)
+: fd(socket)
+{}
+
+WorkerPool::connection::~connection()
+{
+    close(fd);
+}
+
+WorkerPool::WorkerPool()
+: _timeout(std::chrono::seconds(35))
+, _urls_per_timeout(1)
+, _listen_fd(-1)
+, _running(false)
+, _next_id(0)
+, _restarts(0)
+{}
+
+WorkerPool::~WorkerPool()
+{
+    stop();
+}
+
+bool WorkerPool::start(const string &socket_path,
+                       const std::uint16_t processes, const string &program,
+                       const std::chrono::milliseconds &timeout,
+                       const std::uint16_t urls_per_timeout)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_running)
+    {
+        return true;
+    }
+
+    sockaddr_un address;
+    if (!make_address(socket_path, address))
+    {
+        return false;
+    }
+
+    _listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (_listen_fd == -1)
+    {
+        syslog(LOG_ERR, "Could not create socket: %s", std::strerror(errno));
+        return false;
+    }
+
+    // A socket file left behind by a crash would make bind() fail.
+    unlink(socket_path.c_str());
+    if (bind(_listen_fd, reinterpret_cast<sockaddr*>(&address),
+             sizeof(address)) != 0
+        || chmod(socket_path.c_str(), 0600) != 0
+        || listen(_listen_fd, 16) != 0)
+    {
+        syslog(LOG_ERR, "Could not listen on %s: %s", socket_path.c_str(),
+               std::strerror(errno));
+        close(_listen_fd);
+        _listen_fd = -1;
+        return false;
+    }
+
+    _socket_path = socket_path;
+    _program = program;
+    _timeout = timeout;
+    _urls_per_timeout = (urls_per_timeout > 0 ? urls_per_timeout : 1);
+    _running = true;
+    _processes.resize(processes);
+    for (process &p : _processes)
+    {
+        p.pid = spawn();
+        p.started = steady_clock::now();
+    }
+
+    _acceptor = std::thread(&WorkerPool::accept_workers, this);
+    _supervisor = std::thread(&WorkerPool::supervise, this);
+    syslog(LOG_NOTICE, "Expanding URLs in worker processes, listening on %s.",
+           socket_path.c_str());
+
+    return true;
+}
+
+void WorkerPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_running)
+        {
+            return;
+        }
+        _running = false;
+    }
+    _cv.notify_all();
+
+    // Wakes up accept().
+    shutdown(_listen_fd, SHUT_RDWR);
+    _acceptor.join();
+    close(_listen_fd);
+    _listen_fd = -1;
+    unlink(_socket_path.c_str());
+    _supervisor.join();
+
+    // Closing the connections makes the workers exit and fails their jobs.
+    std::vector<std::shared_ptr<connection>> connections;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        connections.swap(_connections);
+    }
+    for (const auto &conn : connections)
+    {
+        shutdown(conn->fd, SHUT_RDWR);
+        conn->reader.join();
+    }
+
+    for (process &p : _processes)
+    {
+        if (p.pid > 0)
+        {
+            kill(p.pid, SIGTERM);
+            waitpid(p.pid, nullptr, 0);
+        }
+    }
+    _processes.clear();
+}
+
+bool WorkerPool::is_running() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _running;
+}
+
+bool WorkerPool::expand(const std::vector<string> &urls,
+                        std::vector<expand_result> &results)
+{
+    if (urls.empty())
+    {
+        results.clear();
+        return true;
+    }
+    if (urls.size() > max_string)
+    {
+        return false;
+    }
+
+    auto j = std::make_shared<job>();
+    j->urls = urls;
+    std::future<std::vector<expand_result>> future = j->promise.get_future();
+    std::shared_ptr<connection> conn;
+    std::uint32_t id;
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        const auto alive = [](const std::shared_ptr<connection> &c)
+        {
+            return c->alive;
+        };
+
+        // Workers may still be starting or restarting.
+        _cv.wait_for(lock, std::chrono::seconds(5), [this, &alive]
+        {
+            return !_running || std::any_of(_connections.begin(),
+                                            _connections.end(), alive);
+        });
+        for (const auto &c : _connections)
+        {
+            if (c->alive && (!conn || c->jobs.size() < conn->jobs.size()))
+            {
+                conn = c;
+            }
+        }
+        if (!_running || !conn)
+        {
+            syslog(LOG_WARNING, "No expander worker available.");
+            return false;
+        }
+        id = _next_id++;
+        if (conn->jobs.empty())
+        {
+            conn->busy_until = steady_clock::now() + get_timeout(*j);
+        }
+        conn->jobs[id] = j;
+    }
+
+    frame_writer frame('E', id);
+    frame.put16(static_cast<std::uint16_t>(urls.size()));
+    for (const string &url : urls)
+    {
+        frame.put_string(url);
+    }
+    bool sent;
+    {
+        std::lock_guard<std::mutex> lock(conn->write_mutex);
+        sent = write_full(conn->fd, frame.finish());
+    }
+    if (!sent)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        // If the job is gone, the reader has already failed it.
+        if (conn->jobs.erase(id) > 0)
+        {
+            return false;
+        }
+    }
+
+    results = future.get();
+    return true;
+}
+
+std::size_t WorkerPool::get_workers() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return static_cast<std::size_t>(
+        std::count_if(_connections.begin(), _connections.end(),
+                      [](const std::shared_ptr<connection> &c)
+                      { return c->alive; }));
+}
+
+std::uint64_t WorkerPool::get_restarts() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _restarts;
+}
+
+void WorkerPool::accept_workers()
+{
+    while (true)
+    {
+        const int fd = accept4(_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_running)
+        {
+            if (fd != -1)
+            {
+                close(fd);
+            }
+            return;
+        }
+        if (fd == -1)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+            {
+                syslog(LOG_ERR, "accept(): %s", std::strerror(errno));
+            }
+            continue;
+        }
+
+        auto conn = std::make_shared<connection>(fd);
+        conn->reader = std::thread(&WorkerPool::read_results, this, conn);
+        _connections.push_back(conn);
+    }
+}
+
+void WorkerPool::read_results(std::shared_ptr<connection> conn)
+{
+    string payload;
+    while (read_frame(conn->fd, payload))
+    {
+        frame_reader frame(payload);
+        const char type = static_cast<char>(frame.get8());
+        const std::uint32_t id = frame.get32();
+
+        if (type == 'H')
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            conn->pid = static_cast<pid_t>(frame.get32());
+            conn->alive = true;
+            syslog(LOG_INFO, "Expander worker %d connected.",
+                   static_cast<int>(conn->pid));
+            _cv.notify_all();
+            continue;
+        }
+        if (type != 'R')
+        {
+            syslog(LOG_ERR, "Unknown frame type %d from worker.", type);
+            break;
+        }
+
+        std::shared_ptr<job> j;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = conn->jobs.find(id);
+            if (it == conn->jobs.end())
+            {
+                continue;
+            }
+            j = it->second;
+            conn->jobs.erase(it);
+            if (!conn->jobs.empty())
+            {
+                conn->busy_until = steady_clock::now()
+                    + get_timeout(*conn->jobs.begin()->second);
+            }
+        }
+
+        std::vector<expand_result> results;
+        const std::uint16_t count = frame.get16();
+        for (std::uint16_t i = 0; i < count && frame.ok(); ++i)
+        {
+            expand_result result;
+            const std::uint8_t flags = frame.get8();
+            result.ok = (flags & 1) != 0;
+            result.unavailable = (flags & 2) != 0;
+            result.url = frame.get_string();
+            const std::uint8_t hops = frame.get8();
+            for (std::uint8_t h = 0; h < hops && frame.ok(); ++h)
+            {
+                expand_hop hop;
+                hop.code = frame.get16();
+                hop.get = frame.get8() != 0;
+                hop.latency = std::chrono::milliseconds(frame.get32());
+                hop.url = frame.get_string();
+                result.hops.push_back(hop);
+            }
+            results.push_back(result);
+        }
+
+        if (!frame.ok() || results.size() != j->urls.size())
+        {
+            syslog(LOG_ERR, "Invalid result from worker %d.",
+                   static_cast<int>(conn->pid));
+            j->promise.set_value(failed(j->urls));
+            break;
+        }
+        j->promise.set_value(results);
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (conn->pid > 0)
+    {
+        syslog(LOG_INFO, "Expander worker %d disconnected.",
+               static_cast<int>(conn->pid));
+    }
+    conn->alive = false;
+    conn->finished = true;
+    fail_jobs(*conn);
+}
+
+std::chrono::milliseconds WorkerPool::get_timeout(const job &j) const
+{
+    // The worker expands _urls_per_timeout URLs at a time, each within the
+    // deadline.
+    const std::size_t rounds =
+        (j.urls.size() + _urls_per_timeout - 1) / _urls_per_timeout;
+
+    return _timeout * static_cast<long>(std::max<std::size_t>(rounds, 1));
+}
+
+void WorkerPool::fail_jobs(connection &conn)
+{
+    for (auto &pair : conn.jobs)
+    {
+        pair.second->promise.set_value(failed(pair.second->urls));
+    }
+    conn.jobs.clear();
+}
+
+void WorkerPool::supervise()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_running)
+    {
+        _cv.wait_for(lock, std::chrono::milliseconds(500),
+                     [this] { return !_running; });
+        if (!_running)
+        {
+            break;
+        }
+        const steady_clock::time_point now = steady_clock::now();
+
+        // Kill workers that hang. Their jobs fail when the connection is
+        // closed.
+        std::vector<std::shared_ptr<connection>> finished;
+        for (auto it = _connections.begin(); it != _connections.end();)
+        {
+            const std::shared_ptr<connection> &conn = *it;
+            const bool late = !conn->jobs.empty() && now > conn->busy_until;
+            if (late && conn->alive)
+            {
+                syslog(LOG_WARNING, "Expander worker %d timed out.",
+                       static_cast<int>(conn->pid));
+                conn->alive = false;
+                const bool own = std::any_of(
+                    _processes.begin(), _processes.end(),
+                    [&conn](const process &p) { return p.pid == conn->pid; });
+                if (own)
+                {
+                    kill(conn->pid, SIGKILL);
+                }
+                shutdown(conn->fd, SHUT_RDWR);
+            }
+
+            if (conn->finished)
+            {
+                finished.push_back(conn);
+                it = _connections.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+
+        // Restart workers that exited.
+        for (process &p : _processes)
+        {
+            int status;
+            if (p.pid > 0 && waitpid(p.pid, &status, WNOHANG) == p.pid)
+            {
+                syslog(LOG_WARNING, "Expander worker %d exited with %d.",
+                       static_cast<int>(p.pid),
+                       WIFEXITED(status) ? WEXITSTATUS(status)
+                                         : 128 + WTERMSIG(status));
+                p.pid = 0;
+                // A worker that ran for a while starts the back-off from the
+                // beginning.
+                if (now - p.started > std::chrono::minutes(5))
+                {
+                    p.restarts = 0;
+                }
+                p.restart_at = now + backoff(p.restarts,
+                                             std::chrono::seconds(1),
+                                             std::chrono::minutes(1));
+                if (p.restarts < UINT8_MAX)
+                {
+                    ++p.restarts;
+                }
+            }
+            if (p.pid <= 0 && now >= p.restart_at)
+            {
+                p.pid = spawn();
+                p.started = now;
+                if (p.pid > 0)
+                {
+                    ++_restarts;
+                }
+                else
+                {
+                    p.restart_at = now + std::chrono::minutes(1);
+                }
+            }
+        }
+
+        // The readers are done, joining them is quick.
+        lock.unlock();
+        for (const auto &conn : finished)
+        {
+            conn->reader.join();
+        }
+        lock.lock();
+    }
+}
+
+pid_t WorkerPool::spawn()
+{
+    string program = _program;
+    string flag = "--expander";
+    string socket = _socket_path;
+    char *argv[] = { &program[0], &flag[0], &socket[0], nullptr };
+
+    pid_t pid;
+    const int error = posix_spawn(&pid, _program.c_str(), nullptr, nullptr,
+                                  argv, environ);
+    if (error != 0)
+    {
+        syslog(LOG_ERR, "Could not start expander worker: %s",
+               std::strerror(error));
+        return 0;
+    }
+
+    return pid;
+}
+
+WorkerPool &get_worker_pool()
+{
+    static WorkerPool pool;
+
+    return pool;
+}
+
+int run_expander_worker(const string &socket_path,
+                        const std::function<const std::vector<expand_result>(
+                            const std::vector<string> &)> &expand)
+{
+    sockaddr_un address;
+    if (!make_address(socket_path, address))
+    {
+        return 1;
+    }
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1
+        || connect(fd, reinterpret_cast<sockaddr*>(&address),
+                   sizeof(address)) != 0)
+    {
+        syslog(LOG_ERR, "Could not connect to %s: %s", socket_path.c_str(),
+               std::strerror(errno));
+        return 1;
+    }
+
+    frame_writer hello('H', 0);
+    hello.put32(static_cast<std::uint32_t>(getpid()));
+    if (!write_full(fd, hello.finish()))
+    {
+        close(fd);
+        return 1;
+    }
+
+    string payload;
+    while (read_frame(fd, payload))
+    {
+        frame_reader frame(payload);
+        const char type = static_cast<char>(frame.get8());
+        const std::uint32_t id = frame.get32();
+        std::vector<string> urls(frame.get16());
+        for (string &url : urls)
+        {
+            url = frame.get_string();
+        }
+        if (type != 'E' || !frame.ok())
+        {
+            syslog(LOG_ERR, "Invalid job from %s.", socket_path.c_str());
+            break;
+        }
+
+        const std::vector<expand_result> results = expand(urls);
+        frame_writer answer('R', id);
+        answer.put16(static_cast<std::uint16_t>(results.size()));
+        for (const expand_result &result : results)
+        {
+            answer.put8(static_cast<std::uint8_t>(
+                (result.ok ? 1 : 0) | (result.unavailable ? 2 : 0)));
+            answer.put_string(result.url);
+            const std::size_t hops = std::min<std::size_t>(result.hops.size(),
+                                                           UINT8_MAX);
+            answer.put8(static_cast<std::uint8_t>(hops));
+            for (std::size_t h = 0; h < hops; ++h)
+            {
+                const expand_hop &hop = result.hops[h];
+                answer.put16(static_cast<std::uint16_t>(hop.code));
+                answer.put8(hop.get ? 1 : 0);
+                answer.put32(static_cast<std::uint32_t>(hop.latency.count()));
+                answer.put_string(hop.url);
+            }
+        }
+        if (!write_full(fd, answer.finish()))
+        {
+            break;
+        }
+    }
+
+    close(fd);
+    return 0;
+}
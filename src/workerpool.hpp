@@ -0,0 +1,210 @@
+/*  This file is part of expandurl-mastodon.
+ *  Copyright © 2019 tastytea <tastytea@tastytea.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, version 3.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WORKERPOOL_HPP
+#define WORKERPOOL_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <chrono>
+#include <cstdint>
+#include <sys/types.h>
+#include "expander.hpp"
+
+using std::string;
+
+/*!
+ *  @brief  Expands URLs in separate worker processes
+ *
+ *          The pool listens on a Unix domain socket. Workers connect to it
+ *          and receive lists of URLs, which they expand with an Expander and
+ *          send back. A worker that hangs or crashes only loses the jobs it
+ *          is working on, the stream of the main process is not affected.
+ *
+ *          The pool starts `processes` workers by running `program
+ *          --expander <socket>` and restarts them if they exit. A worker
+ *          that works on a job for longer than `timeout` for every
+ *          `urls_per_timeout` URLs in it is killed. More workers can be
+ *          started by hand with the same command line, on other cores or with
+ *          other limits.
+ *
+ *          Each message is a frame: the length of the payload as a 32-bit
+ *          big-endian integer, followed by the payload. The payload begins
+ *          with one byte for the type and the 32-bit job ID:
+ *          - `H`: The worker says hello, followed by its process ID.
+ *          - `E`: Expand these URLs, a 16-bit count and the URLs.
+ *          - `R`: The results, a 16-bit count and per URL: 1 byte flags
+ *            (1: `ok`, 2: `unavailable`), the URL, the number of hops (1 byte)
+ *            and per hop: the 16-bit status code, 1 byte `get`, the latency
+ *            in milliseconds (32 bits) and the URL.
+ *
+ *          Strings are sent as a 16-bit length and the bytes.
+ *
+ *          Example:
+ *  @code
+ *          WorkerPool &pool = get_worker_pool();
+ *          pool.start("/run/user/1000/expandurl-mastodon.sock", 4,
+ *                     "/usr/bin/expandurl-mastodon", std::chrono::seconds(35),
+ *                     8);
+ *          std::vector<expand_result> results;
+ *          if (!pool.expand(urls, results)) { … expand locally … }
+ *  @endcode
+ */
+class WorkerPool
+{
+public:
+    WorkerPool();
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    /*!
+     *  @brief  Listens on `socket_path` and starts the workers
+     *
+     *  @param  socket_path Path of the Unix domain socket
+     *  @param  processes   Number of workers to start and supervise, 0 to
+     *                      only accept workers that were started by hand
+     *  @param  program             Path of the executable for the workers
+     *  @param  timeout             Maximum time for `urls_per_timeout` URLs
+     *  @param  urls_per_timeout    Number of URLs a worker expands at the
+     *                              same time
+     *
+     *  @return `false` if the socket could not be created
+     */
+    bool start(const string &socket_path, const std::uint16_t processes,
+               const string &program,
+               const std::chrono::milliseconds &timeout,
+               const std::uint16_t urls_per_timeout = 1);
+
+    /*!
+     *  @brief  Stops the workers and closes the socket
+     */
+    void stop();
+
+    /*!
+     *  @brief  Returns `true` between start() and stop()
+     */
+    bool is_running() const;
+
+    /*!
+     *  @brief  Expands `urls` in the least busy worker
+     *
+     *          If the worker dies or times out, the URLs are returned
+     *          unchanged and not `ok`.
+     *
+     *  @param  urls    URLs to expand
+     *  @param  results Is set to the results, in the same order as `urls`
+     *
+     *  @return `false` if no worker is connected
+     */
+    bool expand(const std::vector<string> &urls,
+                std::vector<expand_result> &results);
+
+    /*!
+     *  @brief  Returns the number of connected workers
+     */
+    std::size_t get_workers() const;
+
+    /*!
+     *  @brief  Returns the number of workers that were restarted
+     */
+    std::uint64_t get_restarts() const;
+
+private:
+    struct job
+    {
+        std::vector<string> urls;
+        std::promise<std::vector<expand_result>> promise;
+    };
+
+    // The socket stays open until the connection is destroyed, so that it
+    // can be shut down from any thread at any time.
+    struct connection
+    {
+        explicit connection(const int socket);
+        ~connection();
+
+        const int fd;
+        pid_t pid = 0;
+        //! Said hello and did not time out
+        bool alive = false;
+        //! The reader is done
+        bool finished = false;
+        std::map<std::uint32_t, std::shared_ptr<job>> jobs;
+        //! Workers do one job at a time, when the current one has to be done
+        std::chrono::steady_clock::time_point busy_until;
+        std::mutex write_mutex;
+        std::thread reader;
+    };
+
+    struct process
+    {
+        pid_t pid = 0;
+        std::uint8_t restarts = 0;
+        std::chrono::steady_clock::time_point started;
+        std::chrono::steady_clock::time_point restart_at;
+    };
+
+    string _socket_path;
+    string _program;
+    std::chrono::milliseconds _timeout;
+    std::uint16_t _urls_per_timeout;
+    int _listen_fd;
+    bool _running;
+    std::uint32_t _next_id;
+    std::uint64_t _restarts;
+    std::vector<std::shared_ptr<connection>> _connections;
+    std::vector<process> _processes;
+    mutable std::mutex _mutex;
+    std::condition_variable _cv;
+    std::thread _acceptor;
+    std::thread _supervisor;
+
+    void accept_workers();
+    void read_results(std::shared_ptr<connection> conn);
+    void supervise();
+    pid_t spawn();
+    void fail_jobs(connection &conn);
+    // Time a worker may need for `j`.
+    std::chrono::milliseconds get_timeout(const job &j) const;
+};
+
+/*!
+ *  @brief  Returns the worker pool of the process
+ */
+WorkerPool &get_worker_pool();
+
+/*!
+ *  @brief  Main loop of a worker process
+ *
+ *          Connects to `socket_path` and expands URLs with `expand` until the
+ *          connection is closed.
+ *
+ *  @return Exit code for the process
+ */
+int run_expander_worker(const string &socket_path,
+                        const std::function<const std::vector<expand_result>(
+                            const std::vector<string> &)> &expand);
+
+#endif  // WORKERPOOL_HPP